@@ -0,0 +1,130 @@
+/*
+ * aclinedump.c - AC line zero crossing recorder
+ * Streams zero crossing timestamps and periods from aclinedrv.ko
+ * ring buffer (/dev/acline) into a binary file, for offline analysis.
+ *
+ * Output is a raw array of struct acline_sample, in host byte order.
+ * Samples missed because the ring buffer overran are reported on
+ * the lost field of the next sample written.
+ *
+ * Copyright (C) 2019 Victor Preatoni
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "modules/aclinedrv_ioctl.h"
+
+/* Where to print messages */
+#define FPRINTF_FD				stderr
+/* Samples read at once */
+#define READ_SAMPLES			64
+
+
+static volatile sig_atomic_t stop = 0;
+
+static void aclinedump_signal(int sig)
+{
+	stop = 1;
+	return;
+}
+
+static void aclinedump_print_params(char *argv)
+{
+	fprintf(FPRINTF_FD, "\nOpenIndoor AC line zero crossing recorder\n\n");
+	fprintf(FPRINTF_FD, "Usage:\n");
+	fprintf(FPRINTF_FD, "%s [-n samples] [file]\n", argv);
+	fprintf(FPRINTF_FD, "-n [samples]\tto stop after that many zero crossings. Runs until Ctrl-C by default\n");
+	fprintf(FPRINTF_FD, "[file]\t\tbinary output file. Standard output if not passed\n");
+	fprintf(FPRINTF_FD, "\nEg: %s -n 3000 mains.bin\tto record 30sec of 50Hz mains\n", argv);
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	struct acline_sample samples[READ_SAMPLES];
+	struct acline_stats stats;
+	struct sigaction sa;
+	unsigned long long limit = 0;
+	unsigned long long count = 0;
+	unsigned long long lost = 0;
+	size_t n, i;
+	ssize_t len;
+	FILE *out = stdout;
+	int fd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				limit = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				aclinedump_print_params(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		out = fopen(argv[optind], "wb");
+		if (!out) {
+			fprintf(FPRINTF_FD, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	fd = open(ACLINE_DEVICE, O_RDONLY);
+	if (fd < 0) {
+		fprintf(FPRINTF_FD, "Cannot open %s: %s\n", ACLINE_DEVICE, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* No SA_RESTART, so Ctrl-C breaks blocking read() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = aclinedump_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop && (!limit || count < limit)) {
+		n = READ_SAMPLES;
+		if (limit && limit - count < n)
+			n = limit - count;
+
+		len = read(fd, samples, n * sizeof(struct acline_sample));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(FPRINTF_FD, "Error reading %s: %s\n", ACLINE_DEVICE, strerror(errno));
+			break;
+		}
+
+		n = len / sizeof(struct acline_sample);
+		for (i = 0; i < n; i++)
+			lost += samples[i].lost;
+
+		if (fwrite(samples, sizeof(struct acline_sample), n, out) != n) {
+			fprintf(FPRINTF_FD, "Error writing output: %s\n", strerror(errno));
+			break;
+		}
+		count += n;
+	}
+
+	if (!ioctl(fd, ACLINE_IOC_STATS, &stats))
+		fprintf(FPRINTF_FD, "%llu samples written, %llu lost. Driver: %llu zero crossings, %llu lost by all readers\n",
+				count, lost, (unsigned long long)stats.samples, (unsigned long long)stats.total_lost);
+	else
+		fprintf(FPRINTF_FD, "%llu samples written, %llu lost\n", count, lost);
+
+	close(fd);
+	if (out != stdout)
+		fclose(out);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,420 @@
+#include "backend.h"
+
+
+/* Selects hardware backend. With no root directory, real board is used.
+ * Otherwise board lives under root: a fake device-tree is generated
+ * there if missing, and Kernel modules are emulated with plain files
+ * standing for their sysfs nodes. An existing fake device-tree is kept,
+ * so it can be edited by hand (eg: fewer channels, other labels)
+ */
+int backend_init(const char *root, unsigned int channels)
+{
+	char filename[512];
+	size_t len;
+
+	if (root == NULL || !root[0]) {
+		backend = &backend_real;
+		backend_root_dir[0] = '\0';
+		return 0;
+	}
+
+	len = snprintf(backend_root_dir, sizeof(backend_root_dir), "%s", root);
+	if (len >= sizeof(backend_root_dir)) {
+		fprintf(FPRINTF_FD, "backend_init: root directory name too long\n");
+		backend_root_dir[0] = '\0';
+		return EXIT_FAILURE;
+	}
+	/* Paths are appended with their own leading slash */
+	while (len > 1 && backend_root_dir[len - 1] == '/')
+		backend_root_dir[--len] = '\0';
+
+	backend = &backend_fake;
+
+	snprintf(filename, sizeof(filename), "%s%s/%s", backend_root_dir, HAT_DIR, HAT_VENDOR_FILE);
+	if (access(filename, F_OK) == 0)
+		fprintf(FPRINTF_FD, "backend_init: fake board on %s\n", backend_root_dir);
+	else if (backend_fake_create_board(channels))
+		return EXIT_FAILURE;
+	else
+		fprintf(FPRINTF_FD, "backend_init: fake board created on %s\n", backend_root_dir);
+
+	return 0;
+}
+
+/* Prepended to every board path, empty on real hardware */
+const char *backend_root(void)
+{
+	return backend_root_dir;
+}
+
+int backend_load_module(const char *name, const char *params)
+{
+	return backend->load_module(name, params);
+}
+
+void backend_unload_module(const char *name)
+{
+	backend->unload_module(name);
+	return;
+}
+
+/* Module left loaded by a previous daemon, eg: on a warm restart */
+bool backend_module_loaded(const char *name)
+{
+	char filename[512];
+
+	snprintf(filename, sizeof(filename), "%s%s/%s", backend_root_dir, LOADED_MODULES_DIR, name);
+
+	return access(filename, F_OK) == 0;
+}
+
+
+
+/* Finds module file path on modules.dep, eg: extra/aclinedrv.ko
+ * Compressed modules are found too (eg: aclinedrv.ko.xz)
+ */
+int backend_find_module(const char *name, char *path, size_t size)
+{
+	FILE *fp;
+	struct utsname uts;
+	char line[512];
+	char *base, *end;
+	size_t name_len = strlen(name);
+
+	if (uname(&uts))
+		return EXIT_FAILURE;
+
+	snprintf(line, sizeof(line), "%s/%s/%s", MODULES_ROOT, uts.release, MODULES_DEP);
+	fp = fopen(line, "r");
+	if (fp == NULL)
+		return EXIT_FAILURE;
+
+	while (fgets(line, sizeof(line), fp)) {
+		end = strchr(line, ':');
+		if (end == NULL)
+			continue;
+		*end = '\0';
+
+		base = strrchr(line, '/');
+		base = base ? base + 1 : line;
+		if (strncmp(base, name, name_len) || strncmp(base + name_len, ".ko", 3))
+			continue;
+
+		fclose(fp);
+		/* Relative paths are relative to modules directory */
+		if (line[0] == '/')
+			snprintf(path, size, "%s", line);
+		else
+			snprintf(path, size, "%s/%s/%s", MODULES_ROOT, uts.release, line);
+		return 0;
+	}
+
+	fclose(fp);
+	return EXIT_FAILURE;
+}
+
+/* Loads a kernel module with finit_module(), no shell nor modprobe
+ * involved. Dependencies must already be loaded.
+ * A module already loaded is not an error
+ */
+int backend_real_load_module(const char *name, const char *params)
+{
+	char path[512];
+	int fd, flags = 0;
+	size_t len;
+
+	if (backend_find_module(name, path, sizeof(path))) {
+		fprintf(FPRINTF_FD, "backend_load_module: %s not found on %s, run depmod\n", name, MODULES_DEP);
+		return EXIT_FAILURE;
+	}
+
+	len = strlen(path);
+	if (len < 3 || strcmp(path + len - 3, ".ko"))
+		flags |= MODULE_INIT_COMPRESSED_FILE;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(FPRINTF_FD, "backend_load_module: %s - %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (syscall(SYS_finit_module, fd, params, flags) && errno != EEXIST) {
+		fprintf(FPRINTF_FD, "backend_load_module: %s - %s\n", name, strerror(errno));
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	close(fd);
+	return 0;
+}
+
+void backend_real_unload_module(const char *name)
+{
+	if (syscall(SYS_delete_module, name, O_NONBLOCK) && errno != ENOENT)
+		fprintf(FPRINTF_FD, "backend_unload_module: %s - %s\n", name, strerror(errno));
+
+	return;
+}
+
+
+
+/* Writes device-tree nodes of a board with one input
+ * and up to FAKE_MAX_CHANNELS outputs, named TRIACn.
+ * Integers are big endian, strings NUL terminated, as on a real HAT
+ */
+int backend_fake_create_board(unsigned int channels)
+{
+	unsigned int i;
+	uint32_t value;
+	char filename[512];
+	char label[16];
+	int len;
+
+	if (channels == 0 || channels > FAKE_MAX_CHANNELS)
+		channels = FAKE_MAX_CHANNELS;
+
+	/* Daemon only creates last level of calibration cache directory */
+	snprintf(filename, sizeof(filename), "%s%s/", backend_root_dir, STATE_DIR);
+	if (backend_fake_mkdirs(filename))
+		goto write_error;
+
+	if (backend_fake_write(HAT_DIR "/" HAT_VENDOR_FILE, FAKE_VENDOR, sizeof(FAKE_VENDOR)))
+		goto write_error;
+	if (backend_fake_write(HAT_DIR "/" HAT_PRODUCT_FILE, FAKE_PRODUCT, sizeof(FAKE_PRODUCT)))
+		goto write_error;
+	value = htonl(FAKE_VERSION);
+	if (backend_fake_write(HAT_DIR "/" HAT_VERSION_FILE, &value, sizeof(value)))
+		goto write_error;
+	if (backend_fake_write(HAT_SERIAL_FILE, FAKE_SERIAL, sizeof(FAKE_SERIAL)))
+		goto write_error;
+
+	value = htonl(1);
+	if (backend_fake_write(HAT_DIR HAT_INPUTS_DIR "/" HAT_IO_CHANNELS, &value, sizeof(value)))
+		goto write_error;
+	value = htonl(FAKE_INPUT_PIN);
+	if (backend_fake_write(HAT_DIR HAT_INPUTS_DIR "/1/" HAT_GPIO_PIN, &value, sizeof(value)))
+		goto write_error;
+
+	value = htonl(channels);
+	if (backend_fake_write(HAT_DIR HAT_OUTPUTS_DIR "/" HAT_IO_CHANNELS, &value, sizeof(value)))
+		goto write_error;
+	for (i = 0; i < channels; i++) {
+		value = htonl(fake_output_pins[i]);
+		snprintf(filename, sizeof(filename), "%s%s/%u/%s", HAT_DIR, HAT_OUTPUTS_DIR, i + 1, HAT_GPIO_PIN);
+		if (backend_fake_write(filename, &value, sizeof(value)))
+			goto write_error;
+		len = snprintf(label, sizeof(label), "TRIAC%u", i + 1);
+		snprintf(filename, sizeof(filename), "%s%s/%u/%s", HAT_DIR, HAT_OUTPUTS_DIR, i + 1, HAT_GPIO_LABEL);
+		if (backend_fake_write(filename, label, len + 1))
+			goto write_error;
+	}
+
+	return 0;
+
+
+write_error:
+	fprintf(FPRINTF_FD, "backend_fake_create_board error: %d - %s\n", errno, strerror(errno));
+	return EXIT_FAILURE;
+}
+
+/* Emulates aclinedrv and triacdrv sysfs nodes and parameters.
+ * Nothing calibrates here, so aclinedrv hysteresis is reported
+ * as calibrated and goes to calibration cache on exit
+ */
+int backend_fake_load_module(const char *name, const char *params)
+{
+	char filename[128];
+	char value[256];
+	char buffer[64];
+	char *label, *saveptr;
+	unsigned int optohyst = FAKE_OPTOHYST_US;
+	unsigned int period = FAKE_PERIOD_NS;
+	unsigned int pos = 0, neg = 0;
+	int len;
+
+	if (backend_module_loaded(name))
+		return 0;
+
+	if (!strcmp(name, "aclinedrv")) {
+		if (backend_fake_param(params, "optohyst", value, sizeof(value)))
+			optohyst = strtoul(value, NULL, 10);
+		if (backend_fake_param(params, "period", value, sizeof(value)) && strtoul(value, NULL, 10))
+			period = strtoul(value, NULL, 10);
+
+		if (backend_fake_write(MODULE_DIR "/" MODULE_BATCH_FILE, "0\n", 2))
+			goto write_error;
+		len = snprintf(buffer, sizeof(buffer), "%uus\n", optohyst);
+		if (backend_fake_write(MODULE_DIR "/" MODULE_OPTOHYST_FILE, buffer, len))
+			goto write_error;
+		len = snprintf(buffer, sizeof(buffer), "%u\n", period);
+		snprintf(filename, sizeof(filename), "%s/%s/%s/period", LOADED_MODULES_DIR, name, MODULE_PARAMS_DIR);
+		if (backend_fake_write(filename, buffer, len))
+			goto write_error;
+	}
+	else if (!strcmp(name, "triacdrv")) {
+		/* Same dependency as on modules.dep */
+		if (!backend_module_loaded("aclinedrv")) {
+			fprintf(FPRINTF_FD, "backend_load_module: %s - unknown symbols, aclinedrv not loaded\n", name);
+			return EXIT_FAILURE;
+		}
+		if (backend_fake_param(params, "pos", value, sizeof(value)))
+			pos = strtoul(value, NULL, 10);
+		if (backend_fake_param(params, "neg", value, sizeof(value)))
+			neg = strtoul(value, NULL, 10);
+		if (!backend_fake_param(params, "name", value, sizeof(value)))
+			snprintf(value, sizeof(value), "TRIAC1");
+
+		/* Kept on parameters, so nodes can be removed on unload */
+		snprintf(filename, sizeof(filename), "%s/%s/%s/name", LOADED_MODULES_DIR, name, MODULE_PARAMS_DIR);
+		if (backend_fake_write(filename, value, strlen(value)))
+			goto write_error;
+
+		len = snprintf(buffer, sizeof(buffer), "%u %u\n", pos, neg);
+		for (label = strtok_r(value, ",", &saveptr); label; label = strtok_r(NULL, ",", &saveptr)) {
+			snprintf(filename, sizeof(filename), "%s/%s", MODULE_DIR, label);
+			if (backend_fake_write(filename, buffer, len))
+				goto write_error;
+		}
+	}
+	else {
+		fprintf(FPRINTF_FD, "backend_load_module: %s not found on fake board\n", name);
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+
+
+write_error:
+	fprintf(FPRINTF_FD, "backend_load_module: %s - %s\n", name, strerror(errno));
+	backend_fake_unload_module(name);
+	return EXIT_FAILURE;
+}
+
+void backend_fake_unload_module(const char *name)
+{
+	char filename[128];
+	char value[256];
+	char *label, *saveptr;
+
+	if (!strcmp(name, "aclinedrv")) {
+		backend_fake_remove(MODULE_DIR "/" MODULE_BATCH_FILE);
+		backend_fake_remove(MODULE_DIR "/" MODULE_OPTOHYST_FILE);
+		snprintf(filename, sizeof(filename), "%s/%s/%s/period", LOADED_MODULES_DIR, name, MODULE_PARAMS_DIR);
+		backend_fake_remove(filename);
+	}
+	else if (!strcmp(name, "triacdrv")) {
+		snprintf(filename, sizeof(filename), "%s/%s/%s/name", LOADED_MODULES_DIR, name, MODULE_PARAMS_DIR);
+		if (!backend_fake_read(filename, value, sizeof(value))) {
+			for (label = strtok_r(value, ",", &saveptr); label; label = strtok_r(NULL, ",", &saveptr)) {
+				snprintf(filename, sizeof(filename), "%s/%s", MODULE_DIR, label);
+				backend_fake_remove(filename);
+			}
+		}
+		snprintf(filename, sizeof(filename), "%s/%s/%s/name", LOADED_MODULES_DIR, name, MODULE_PARAMS_DIR);
+		backend_fake_remove(filename);
+	}
+
+	snprintf(filename, sizeof(filename), "%s/%s/%s", LOADED_MODULES_DIR, name, MODULE_PARAMS_DIR);
+	backend_fake_remove(filename);
+	snprintf(filename, sizeof(filename), "%s/%s", LOADED_MODULES_DIR, name);
+	backend_fake_remove(filename);
+	/* Only goes once both modules are gone */
+	backend_fake_remove(MODULE_DIR);
+
+	return;
+}
+
+/* Creates or replaces a file under root, and its parent directories */
+int backend_fake_write(const char *path, const void *data, size_t len)
+{
+	char filename[512];
+	ssize_t written;
+	int fd;
+
+	snprintf(filename, sizeof(filename), "%s%s", backend_root_dir, path);
+	if (backend_fake_mkdirs(filename))
+		return EXIT_FAILURE;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return EXIT_FAILURE;
+	written = write(fd, data, len);
+	close(fd);
+
+	return written == (ssize_t)len ? 0 : EXIT_FAILURE;
+}
+
+/* Reads a file under root as a string, trailing newline removed */
+int backend_fake_read(const char *path, char *buffer, size_t size)
+{
+	char filename[512];
+	ssize_t len;
+	int fd;
+
+	snprintf(filename, sizeof(filename), "%s%s", backend_root_dir, path);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return EXIT_FAILURE;
+	len = read(fd, buffer, size - 1);
+	close(fd);
+	if (len <= 0)
+		return EXIT_FAILURE;
+
+	if (buffer[len - 1] == '\n')
+		len--;
+	buffer[len] = '\0';
+
+	return 0;
+}
+
+/* Removes a file or an empty directory under root */
+void backend_fake_remove(const char *path)
+{
+	char filename[512];
+
+	snprintf(filename, sizeof(filename), "%s%s", backend_root_dir, path);
+	remove(filename);
+
+	return;
+}
+
+/* Creates every parent directory of filename, like mkdir -p */
+int backend_fake_mkdirs(char *filename)
+{
+	char *slash;
+
+	for (slash = strchr(filename + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(filename, 0755) && errno != EEXIST) {
+			*slash = '/';
+			return EXIT_FAILURE;
+		}
+		*slash = '/';
+	}
+
+	return 0;
+}
+
+/* Finds key=value on a module parameter string */
+bool backend_fake_param(const char *params, const char *key, char *value, size_t size)
+{
+	size_t key_len = strlen(key);
+	size_t len;
+
+	while (params && *params) {
+		if (!strncmp(params, key, key_len) && params[key_len] == '=') {
+			params += key_len + 1;
+			len = strcspn(params, " ");
+			if (len >= size)
+				len = size - 1;
+			memcpy(value, params, len);
+			value[len] = '\0';
+			return true;
+		}
+		params = strchr(params, ' ');
+		if (params)
+			params++;
+	}
+
+	return false;
+}
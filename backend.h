@@ -0,0 +1,93 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/module.h>
+
+#include "board.h"
+
+
+/* Where to print messages */
+#define FPRINTF_FD					stdout
+/* Kernel modules are looked up here, on modules.dep written by depmod */
+#define MODULES_ROOT			"/lib/modules"
+#define MODULES_DEP				"modules.dep"
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE	4
+#endif
+
+/* Fake board contents, on board.h layout under a root directory */
+#define FAKE_VENDOR				"OpenIndoor"
+#define FAKE_PRODUCT			"Opto-TRIAC fake board\n"
+#define FAKE_VERSION			0x0100
+#define FAKE_SERIAL				"00000000-0000-0000-0000-000000000000"
+#define FAKE_INPUT_PIN			5
+#define FAKE_MAX_CHANNELS		4
+/* What fake aclinedrv reports when no cache is passed */
+#define FAKE_OPTOHYST_US		320U
+#define FAKE_PERIOD_NS			20000000U
+
+/* Hardware backend. Real one loads kernel modules and works on
+ * device-tree, sysfs and /dev as they are. Fake one keeps all of them
+ * as plain files under a root directory, so daemon can run (and be
+ * load-tested) on any Linux machine
+ */
+struct backend_ops {
+	const char *name;
+	int (*load_module)(const char *, const char *);
+	void (*unload_module)(const char *);
+};
+
+/* Same pins as a real quad board */
+static const unsigned int fake_output_pins[FAKE_MAX_CHANNELS] = {26, 19, 13, 6};
+
+/* Prepended to every board path. Empty on real hardware */
+static char backend_root_dir[256] = "";
+
+int backend_init(const char *, unsigned int);
+const char *backend_root(void);
+int backend_load_module(const char *, const char *);
+void backend_unload_module(const char *);
+bool backend_module_loaded(const char *);
+
+/* Real backend */
+int backend_find_module(const char *, char *, size_t);
+int backend_real_load_module(const char *, const char *);
+void backend_real_unload_module(const char *);
+
+/* Fake backend */
+int backend_fake_create_board(unsigned int);
+int backend_fake_load_module(const char *, const char *);
+void backend_fake_unload_module(const char *);
+int backend_fake_write(const char *, const void *, size_t);
+int backend_fake_read(const char *, char *, size_t);
+void backend_fake_remove(const char *);
+int backend_fake_mkdirs(char *);
+bool backend_fake_param(const char *, const char *, char *, size_t);
+
+static const struct backend_ops backend_real = {
+	.name = "real",
+	.load_module = backend_real_load_module,
+	.unload_module = backend_real_unload_module,
+};
+
+static const struct backend_ops backend_fake = {
+	.name = "fake",
+	.load_module = backend_fake_load_module,
+	.unload_module = backend_fake_unload_module,
+};
+
+static const struct backend_ops *backend = &backend_real;
+
+#endif // BACKEND_H
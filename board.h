@@ -0,0 +1,37 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+/* Opto-TRIAC board paths, shared by optoboard.c and backend.c.
+ * All of them are prepended with backend_root(), so fake backend
+ * keeps the very same layout under its root directory
+ */
+
+/* Kernel module sysfs node */
+#define MODULE_DIR				"/sys/triacd"
+/* aclinedrv batch window node */
+#define MODULE_BATCH_FILE		"batch"
+/* aclinedrv live calibration nodes */
+#define MODULE_OPTOHYST_FILE	"optohyst"
+#define ACLINE_PERIOD_PARAM		"/sys/module/aclinedrv/parameters/period"
+/* Loaded kernel modules, one directory each */
+#define LOADED_MODULES_DIR		"/sys/module"
+#define MODULE_PARAMS_DIR		"parameters"
+/* HAT device-tree node */
+#define HAT_DIR					"/proc/device-tree/triacboard"
+#define HAT_INPUTS_DIR			"/in"
+#define HAT_OUTPUTS_DIR			"/out"
+#define HAT_VENDOR_FILE			"vendor"
+#define HAT_PRODUCT_FILE		"product"
+#define HAT_VERSION_FILE		"version"
+#define HAT_GPIO_LABEL			"label"
+#define HAT_GPIO_PIN			"arm_gpio"
+#define HAT_IO_CHANNELS			"channels"
+/* HAT EEPROM serial, cached calibration must match it */
+#define HAT_SERIAL_FILE			"/proc/device-tree/hat/uuid"
+/* Calibration cache. Written on exit, passed back to aclinedrv.ko
+ * on next start so it does not need to calibrate before triggering
+ */
+#define STATE_DIR				"/var/lib/triacd"
+#define STATE_FILE				"calibration"
+
+#endif // BOARD_H
@@ -1,5 +1,8 @@
 #include "fader.h"
 
+struct triac_fade *fader;
+unsigned int triac_fade_len;
+
 /* Initializes fader pointers and variables */
 void fader_init(struct triac_status *triac, unsigned int channels)
 {
@@ -17,7 +20,7 @@ void fader_init(struct triac_status *triac, unsigned int channels)
 	 * so fader can modify data pointed by struct triac_phase *
 	 */
 	for (i = 0; i < triac_fade_len; i++) {
-		fader[i].status = STOPPED;
+		fader[i].active = false;
 		fader[i].phase = &triac[i].phase;
 	}
 	
@@ -35,123 +38,326 @@ void fader_release(void)
 	return;
 }
 
-/* Fading thread launcher
- * Parses channel and fading values and launches thread
- * It also controls wether thread is running or not
+/* Starts a fade, or restarts it with new values if channel
+ * was already fading. Only fader state is updated.
+ * Step count is fixed here from fade time, and every step has its
+ * own deadline counted from start, so fade ends exactly time ms later.
+ * Fade moves at constant speed on selected curve level
  */
-void fader_start(unsigned int i, unsigned int time, unsigned int pos_final, unsigned int neg_final)
+void fader_start(unsigned int i, unsigned int time, unsigned int pos_final, unsigned int neg_final, unsigned int curve)
 {
+	bool restart;
+	
 	/* Pointer overflow check */
 	if (i >= triac_fade_len)
 		return;
 	
-	/* New fading request. Needs to cancel previous thread and start a new one */
-	if (fader[i].status == STARTED) {
-		fader[i].status = ABOUT_TO_STOP;
-		pthread_cancel(fader[i].thread);
-		fader[i].status = STOPPING;
-		//JOIN OR DETACH??? How to catch thread_exit??. cancel or kill+signal?
-		pthread_join(fader[i].thread, NULL);
-		fader[i].status = STOPPED;
-		fprintf(FPRINTF_FD, "fader_start: restarting fade thread\n");
-	}
+	if (curve >= CURVE_COUNT)
+		curve = CURVE_LINEAR;
+	if (pos_final > CURVE_MAX_ANGLE)
+		pos_final = CURVE_MAX_ANGLE;
+	if (neg_final > CURVE_MAX_ANGLE)
+		neg_final = CURVE_MAX_ANGLE;
+	
+	restart = fader[i].active;
 	
-	fader[i].status = ABOUT_TO_START;
+	fader[i].curve = curve;
+	fader[i].from_pos = fader_curve_level(curve, fader[i].phase->pos);
+	fader[i].from_neg = fader_curve_level(curve, fader[i].phase->neg);
+	fader[i].to_pos = fader_curve_level(curve, pos_final);
+	fader[i].to_neg = fader_curve_level(curve, neg_final);
+	fader[i].start_pos = fader[i].phase->pos;
+	fader[i].start_neg = fader[i].phase->neg;
 	fader[i].final_pos = pos_final;
 	fader[i].final_neg = neg_final;
 	fader[i].time = time;
-	if (pthread_create(&fader[i].thread, NULL, fader_function, (void*)i))
-		fprintf(FPRINTF_FD, "fader_start error: cannot start fader\n");
-		
+	fader[i].step = 0;
+	fader[i].steps = (time + FADER_STEP_MS / 2) / FADER_STEP_MS;
+	if (!fader[i].steps)
+		fader[i].steps = 1;
+	
+	clock_gettime(CLOCK_MONOTONIC, &fader[i].start);
+	fader_set_deadline(&fader[i]);
+	fader[i].active = true;
+	
+	if (restart)
+		fprintf(FPRINTF_FD, "fader_start: fader restarted on channel %u\n", i + 1);
+	else
+		fprintf(FPRINTF_FD, "fader_start: fader started on channel %u\n", i + 1);
+	
 	return;
 }
 
-/* Fading thread stopper
- * Stops fading in case it's still running
- */
+/* Stops fading in case it's still running */
 void fader_stop(unsigned int i)
 {
 	/* Pointer overflow check */
 	if (i >= triac_fade_len)
 		return;
 	
-	if (fader[i].status == STARTED) {
-		fader[i].status = ABOUT_TO_STOP;
-		pthread_cancel(fader[i].thread);
-		fader[i].status = STOPPING;
-		pthread_join(fader[i].thread, NULL);
-		fader[i].status = STOPPED;
+	if (fader[i].active) {
+		fader[i].active = false;
 		fprintf(FPRINTF_FD, "fader_stop: fader stopped on channel %u\n", i + 1);
 	}
 	
 	return;
 }
 
-bool float_cmp(float x, float y, float epsilon)
+/* Earliest deadline among running faders.
+ * Returns false if there is none
+ */
+bool fader_next_deadline(struct timespec *deadline)
 {
-	if(fabs(x - y) < epsilon)
-		return true;
-	else 
-		return false;
+	unsigned int i;
+	bool found = false;
+	
+	for (i = 0; i < triac_fade_len; i++) {
+		if (!fader[i].active)
+			continue;
+		if (!found || fader_before(&fader[i].deadline, deadline)) {
+			*deadline = fader[i].deadline;
+			found = true;
+		}
+	}
+	
+	return found;
 }
 
-void * fader_function(void *_args)
+/* Advances every fader whose deadline expired. If main loop woke
+ * up late, missed steps are taken now, so fades end on time
+ */
+void fader_tick(void)
 {
-	unsigned int i = (unsigned int)_args;
+	unsigned int i;
+	struct timespec now;
 	
-	/* Pointer overflow check */
-	if (i >= triac_fade_len)
-		pthread_exit(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	for (i = 0; i < triac_fade_len; i++) {
+		while (fader[i].active && !fader_before(&now, &fader[i].deadline)) {
+			if (fader_step(&fader[i])) {
+				fader[i].active = false;
+				fprintf(FPRINTF_FD, "fader_tick: fader finished on channel %u\n", i + 1);
+			}
+			else
+				fader_set_deadline(&fader[i]);
+		}
+	}
+	
+	return;
+}
+
+/* Curve level at step out of steps, in fixed point.
+ * Computed from start values every time, so there is no accumulated
+ * rounding error and last step is exactly final value
+ */
+int32_t fader_interpolate(int32_t from, int32_t to, unsigned int step, unsigned int steps)
+{
+	return from + (int32_t)((int64_t)(to - from) * step / steps);
+}
+
+/* Curve level of an integer conduction angle */
+int32_t fader_curve_level(enum fade_curve curve, unsigned int angle)
+{
+	if (angle > CURVE_MAX_ANGLE)
+		angle = CURVE_MAX_ANGLE;
+	
+	return curve_level[curve][angle];
+}
+
+/* Conduction angle of a curve level, fixed point.
+ * Interpolated between inverse table points
+ */
+unsigned int fader_curve_angle(enum fade_curve curve, int32_t level)
+{
+	uint32_t scaled, index, frac;
+	const uint32_t *table = curve_angle[curve];
+	
+	if (level <= 0)
+		return table[0];
+	if (level >= CURVE_ONE)
+		return table[CURVE_POINTS];
+	
+	scaled = (uint32_t)level * CURVE_POINTS;
+	index = scaled >> CURVE_SHIFT;
+	frac = scaled & (CURVE_ONE - 1);
+	
+	return table[index] + (uint32_t)(((uint64_t)(table[index + 1] - table[index]) * frac) >> CURVE_SHIFT);
+}
+
+/* Integer conduction angle giving a curve level, eg: a RMS fraction.
+ * Used for setpoints not given in degrees
+ */
+unsigned int fader_level_to_angle(enum fade_curve curve, uint32_t level)
+{
+	if (level > CURVE_ONE)
+		level = CURVE_ONE;
+	
+	return FADER_ROUND(fader_curve_angle(curve, level));
+}
+
+/* Curve level at a fixed point conduction angle.
+ * Interpolated between integer angles
+ */
+uint32_t fader_curve_level_at(enum fade_curve curve, uint32_t angle)
+{
+	uint32_t index = angle >> CURVE_SHIFT;
+	uint32_t frac = angle & (CURVE_ONE - 1);
+	const uint32_t *table = curve_level[curve];
+	
+	if (index >= CURVE_MAX_ANGLE)
+		return table[CURVE_MAX_ANGLE];
+	
+	return table[index] + (uint32_t)(((uint64_t)(table[index + 1] - table[index]) * frac) >> CURVE_SHIFT);
+}
+
+/* Whole AC cycle levels for a pos/neg angle pair.
+ * mean is positive minus negative half cycle mean, so full positive
+ * half-wave is CURVE_ONE. Power is mean of both half cycles, and RMS is
+ * taken from RMS curve at the angle giving that same power, so no sqrt
+ * is needed. Any output pointer can be NULL
+ */
+void fader_cycle_levels(unsigned int pos, unsigned int neg, int32_t *mean, uint32_t *rms, uint32_t *power)
+{
+	uint32_t cycle_power;
 	
-	/* Make backup of globals to work faster and avoid race conditions */
-	unsigned int local_pos = fader[i].phase->pos;
-	unsigned int local_neg = fader[i].phase->neg;
+	if (pos > CURVE_MAX_ANGLE)
+		pos = CURVE_MAX_ANGLE;
+	if (neg > CURVE_MAX_ANGLE)
+		neg = CURVE_MAX_ANGLE;
 	
-	unsigned int delay_step_ms = 50;
-	unsigned int time_slots = fader[i].time / delay_step_ms;
+	cycle_power = (curve_level[CURVE_POWER][pos] + curve_level[CURVE_POWER][neg]) / 2;
 	
-	if (!time_slots) {
-		fprintf(FPRINTF_FD, "fader_function error: cannot fade that fast!\n");
-		pthread_exit(NULL);
+	if (mean)
+		*mean = (int32_t)curve_level[CURVE_MEAN][pos] - (int32_t)curve_level[CURVE_MEAN][neg];
+	if (rms)
+		*rms = fader_curve_level_at(CURVE_RMS, fader_curve_angle(CURVE_POWER, cycle_power));
+	if (power)
+		*power = cycle_power;
+	
+	return;
+}
+
+/* Cycle power for a positive mean level with negative half cycle
+ * conducting neg degrees. Positive angle needed for that mean is
+ * stored on pos, fixed point
+ */
+uint32_t fader_mean_power(uint32_t mean, unsigned int neg, uint32_t *pos)
+{
+	*pos = fader_curve_angle(CURVE_MEAN, mean + curve_level[CURVE_MEAN][neg]);
+	
+	return (fader_curve_level_at(CURVE_POWER, *pos) + curve_level[CURVE_POWER][neg]) / 2;
+}
+
+/* Solves asymmetric angles for a mean (DC) level, -CURVE_ONE to
+ * CURVE_ONE, from tables only.
+ * Without RMS target (zero), the other half cycle is kept off.
+ * With it, mean is kept and negative angle is binary searched:
+ * increasing it also increases positive angle, so cycle power only
+ * grows. RMS targets out of reach for that mean are clamped
+ */
+void fader_solve_mean(int32_t mean, uint32_t rms, unsigned int *pos, unsigned int *neg)
+{
+	uint32_t level, target, pos_fixed;
+	unsigned int low, high, mid, other;
+	unsigned int *main_angle = pos, *other_angle = neg;
+	
+	/* Negative mean is the same problem with half cycles swapped */
+	if (mean < 0) {
+		main_angle = neg;
+		other_angle = pos;
+		mean = -mean;
 	}
+	level = (mean > CURVE_ONE) ? CURVE_ONE : mean;
+	
+	other = 0;
+	if (rms) {
+		if (rms > CURVE_ONE)
+			rms = CURVE_ONE;
+		target = fader_curve_level_at(CURVE_POWER, fader_curve_angle(CURVE_RMS, rms));
 		
-	int delta_pos = fader[i].final_pos - local_pos;
-	int delta_neg = fader[i].final_neg - local_neg;
-	
-	float step_pos = (float)delta_pos / time_slots;
-	float step_neg = (float)delta_neg / time_slots;
-	
-	float accum_pos = local_pos;
-	float accum_neg = local_neg;
-	
-	fader[i].status = STARTED;
-	fprintf(FPRINTF_FD, "fader_function: fader started on channel %u\n", i + 1);
-// 	fprintf(FPRINTF_FD, "fader_function: requested final values %u\t%u\n", fader[i].final_pos, fader[i].final_neg);
-// 	fprintf(FPRINTF_FD, "fader_function: %u steps of %u[ms]\n", time_slots, delay_step_ms);
-// 	fprintf(FPRINTF_FD, "fader_function: deltas %i %i\n", delta_pos, delta_neg);
-// 	fprintf(FPRINTF_FD, "fader_function: steps %f %f\n", step_pos, step_neg);
-
-	while (!float_cmp(accum_pos, fader[i].final_pos, 1) || !float_cmp(accum_neg, fader[i].final_neg, 1)) {
-		if (!float_cmp(accum_pos, fader[i].final_pos, 1)) {
-			accum_pos += step_pos;
-			fader[i].phase->pos = accum_pos;
-			fader[i].phase->refresh = true;
-		}
-		if (!float_cmp(accum_neg, fader[i].final_neg, 1)) {
-			accum_neg += step_neg;
-			fader[i].phase->neg = accum_neg;
-			fader[i].phase->refresh = true;
+		/* Highest other angle that still leaves room for mean */
+		high = 0;
+		while (high < CURVE_MAX_ANGLE && curve_level[CURVE_MEAN][high + 1] + level <= CURVE_ONE)
+			high++;
+		
+		low = 0;
+		while (low < high) {
+			mid = (low + high + 1) / 2;
+			if (fader_mean_power(level, mid, &pos_fixed) <= target)
+				low = mid;
+			else
+				high = mid - 1;
 		}
-		usleep(delay_step_ms * MSEC_TO_USEC);
+		other = low;
 	}
+	
+	fader_mean_power(level, other, &pos_fixed);
+	*main_angle = FADER_ROUND(pos_fixed);
+	*other_angle = other;
+	
+	return;
+}
+
+/* Bounds angle between fade start and final angles. Curves are flat
+ * near 180 degrees, so a level there does not map back to the exact
+ * angle it came from
+ */
+unsigned int fader_clamp(unsigned int angle, unsigned int a, unsigned int b)
+{
+	unsigned int low = (a < b) ? a : b;
+	unsigned int high = (a < b) ? b : a;
+	
+	if (angle < low)
+		return low;
+	if (angle > high)
+		return high;
+	
+	return angle;
+}
+
+/* Single fader step
+ * Returns true when fader reached its final values
+ */
+bool fader_step(struct triac_fade *fade)
+{
+	fade->step++;
+	
+	if (fade->step == fade->steps) {
+		fade->phase->pos = fade->final_pos;
+		fade->phase->neg = fade->final_neg;
+	}
+	else {
+		fade->phase->pos = fader_clamp(FADER_ROUND(fader_curve_angle(fade->curve, fader_interpolate(fade->from_pos, fade->to_pos, fade->step, fade->steps))), fade->start_pos, fade->final_pos);
+		fade->phase->neg = fader_clamp(FADER_ROUND(fader_curve_angle(fade->curve, fader_interpolate(fade->from_neg, fade->to_neg, fade->step, fade->steps))), fade->start_neg, fade->final_neg);
+	}
+	fade->phase->refresh = true;
+	
+	return (fade->step == fade->steps);
+}
+
+/* Deadline of next step, counted from fade start */
+void fader_set_deadline(struct triac_fade *fade)
+{
+	uint64_t offset_ns;
+	
+	offset_ns = (uint64_t)fade->time * MSEC_TO_NANOSEC * (fade->step + 1) / fade->steps;
+	
+	fade->deadline.tv_sec = fade->start.tv_sec + offset_ns / SEC_TO_NANOSEC;
+	fade->deadline.tv_nsec = fade->start.tv_nsec + offset_ns % SEC_TO_NANOSEC;
+	if (fade->deadline.tv_nsec >= SEC_TO_NANOSEC) {
+		fade->deadline.tv_sec++;
+		fade->deadline.tv_nsec -= SEC_TO_NANOSEC;
+	}
+	
+	return;
+}
 
-	fader[i].phase->pos = fader[i].final_pos;
-	fader[i].phase->neg = fader[i].final_neg;
-	fader[i].phase->refresh = true;
+/* Returns true if a is earlier than b */
+bool fader_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
 	
-	fprintf(FPRINTF_FD, "fader_function: fader finished on channel %u\n", i + 1);
-	fader[i].status = ABOUT_TO_STOP;
-	pthread_detach(pthread_self());
-	fader[i].status = STOPPED;
-	pthread_exit(NULL);
+	return a->tv_nsec < b->tv_nsec;
 }
@@ -3,26 +3,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
-#include <math.h>
+#include <time.h>
+
+#include "tables.h"
 
 
 /* Where to print messages */
 #define FPRINTF_FD					stdout
-/* Fader thread status */
-#define STOPPED						0x00
-#define ABOUT_TO_STOP				0x10
-#define STOPPING					0x20
-#define STARTED						0x01
-#define ABOUT_TO_START				0x11
 /* Time constants */
 #define USEC_TO_NANOSEC			1000U
 #define MSEC_TO_NANOSEC			(1000U * USEC_TO_NANOSEC)
 #define SEC_TO_NANOSEC			(1000U * MSEC_TO_NANOSEC)
 #define MSEC_TO_USEC			1000U
-#define THREAD_LATENCY			(100U * MSEC_TO_USEC)
+/* Time between fader steps */
+#define FADER_STEP_MS			50U
+/* Rounds a fixed point angle to degrees */
+#define FADER_ROUND(x)			(((x) + (1 << (CURVE_SHIFT - 1))) >> CURVE_SHIFT)
 
 struct triac_phase {
 	volatile unsigned int pos;
@@ -36,6 +35,8 @@ struct triac_gpio {
 	unsigned pin;
 	/* TRIAC channel friendly name, can be any */
 	char label[16];
+	/* Channel index on triacdrv.ko */
+	unsigned int index;
 	/* GPIO initialization status: disabled unless set by software */
 	enum {disabled, error, enabled} status;
 };
@@ -44,24 +45,59 @@ struct triac_gpio {
 struct triac_status {
 	struct triac_gpio gpio;
 	struct triac_phase phase;
+	/* Persistent sysfs node descriptor, -1 if closed */
+	int sysfs_fd;
 };
 
+/* A fade in progress. All of them are advanced by fader_tick()
+ * from daemon main loop, each one on its own absolute deadline
+ */
 struct triac_fade {
-	pthread_t thread;
 	struct triac_phase *phase;
+	bool active;
+	enum fade_curve curve;
+	/* Start and final curve levels, fixed point */
+	int32_t from_pos;
+	int32_t from_neg;
+	int32_t to_pos;
+	int32_t to_neg;
+	/* Start and final angles. Final ones are set as they are on
+	 * last step, and steps never go outside of them
+	 */
+	unsigned int start_pos;
+	unsigned int start_neg;
 	unsigned int final_pos;
 	unsigned int final_neg;
+	/* Steps taken so far, out of steps */
+	unsigned int step;
+	unsigned int steps;
+	/* Fade time in ms, and CLOCK_MONOTONIC start time */
 	unsigned int time;
-	volatile unsigned int status;
+	struct timespec start;
+	/* CLOCK_MONOTONIC time of next step */
+	struct timespec deadline;
 };
 
-struct triac_fade *fader;
-unsigned int triac_fade_len;
+extern struct triac_fade *fader;
+extern unsigned int triac_fade_len;
 
 
-void fader_start(unsigned int, unsigned int, unsigned int, unsigned int);
+void fader_start(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int);
 void fader_stop(unsigned int);
-void * fader_function(void *arg);
+bool fader_next_deadline(struct timespec *);
+void fader_tick(void);
+bool fader_step(struct triac_fade *);
+int32_t fader_interpolate(int32_t, int32_t, unsigned int, unsigned int);
+int32_t fader_curve_level(enum fade_curve, unsigned int);
+unsigned int fader_curve_angle(enum fade_curve, int32_t);
+unsigned int fader_level_to_angle(enum fade_curve, uint32_t);
+uint32_t fader_curve_level_at(enum fade_curve, uint32_t);
+void fader_cycle_levels(unsigned int, unsigned int, int32_t *, uint32_t *, uint32_t *);
+uint32_t fader_mean_power(uint32_t, unsigned int, uint32_t *);
+void fader_solve_mean(int32_t, uint32_t, unsigned int *, unsigned int *);
+unsigned int fader_clamp(unsigned int, unsigned int, unsigned int);
+void fader_set_deadline(struct triac_fade *);
+bool fader_before(const struct timespec *, const struct timespec *);
 void fader_init(struct triac_status *, unsigned int);
 void fader_release(void);
 
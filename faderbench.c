@@ -0,0 +1,90 @@
+/*
+ * faderbench.c - fader step timing
+ * Runs full fades on TRIACD_SHM_CHANNELS channels, on every fade
+ * curve, and reports average fader_step() time.
+ *
+ * Copyright (C) 2019 Victor Preatoni
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fader.h"
+#include "modules/triacdrv_ioctl.h"
+
+/* Where to print messages */
+#define BENCH_FD				stderr
+/* Fades run on every channel, per curve */
+#define BENCH_FADES				200
+/* 10 second fades, 200 steps each */
+#define BENCH_FADE_MS			10000
+
+
+static int64_t faderbench_elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * SEC_TO_NANOSEC + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(void)
+{
+	struct triac_status triac[TRIACD_SHM_CHANNELS];
+	static const char *curve_names[] = CURVE_NAMES;
+	struct timespec start, end;
+	unsigned int curve, n, i;
+	uint64_t steps;
+	int64_t elapsed_ns;
+	bool done;
+
+	memset(triac, 0, sizeof(triac));
+	fader_init(triac, TRIACD_SHM_CHANNELS);
+	if (fader == NULL) {
+		fprintf(BENCH_FD, "faderbench: out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	/* fader_start() chatter goes to stdout */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		fprintf(BENCH_FD, "faderbench: could not silence fader messages\n");
+
+	for (curve = 0; curve < CURVE_COUNT; curve++) {
+		steps = 0;
+		elapsed_ns = 0;
+
+		for (n = 0; n < BENCH_FADES; n++) {
+			/* Channels fade up and down alternately, from different angles */
+			for (i = 0; i < TRIACD_SHM_CHANNELS; i++) {
+				triac[i].phase.pos = (n & 1) ? CURVE_MAX_ANGLE - i : i;
+				triac[i].phase.neg = (n & 1) ? CURVE_MAX_ANGLE - i : i;
+				fader_start(i, BENCH_FADE_MS, (n & 1) ? i : CURVE_MAX_ANGLE - i, (n & 1) ? i : CURVE_MAX_ANGLE - i, curve);
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			do {
+				done = true;
+				for (i = 0; i < TRIACD_SHM_CHANNELS; i++) {
+					if (!fader[i].active)
+						continue;
+					if (fader_step(&fader[i]))
+						fader[i].active = false;
+					else
+						done = false;
+					steps++;
+				}
+			} while (!done);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			elapsed_ns += faderbench_elapsed_ns(&start, &end);
+		}
+
+		fprintf(BENCH_FD, "faderbench: %-8s %llu steps, %.1fns per step\n", curve_names[curve],
+				(unsigned long long)steps, (double)elapsed_ns / steps);
+	}
+
+	fader_release();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*
+ * fadertest.c - fader unit tests
+ * Runs fader interpolation, steps and deadlines against every
+ * fade curve, with no board nor daemon. Exits with failure status
+ * if any check fails.
+ *
+ * Copyright (C) 2019 Victor Preatoni
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fader.h"
+
+/* Where to print messages */
+#define TEST_FD					stderr
+/* Fade times tried on every curve, ms */
+#define TEST_TIMES				{0, 24, 25, 75, 1000, 1030, 10000}
+/* Conduction angle pairs faded from and to */
+#define TEST_ANGLES				{0, 7, 45, 90, 135, 173, 180}
+
+#define ARRAY_SIZE(a)			(sizeof(a) / sizeof((a)[0]))
+
+static unsigned int checks;
+static unsigned int failures;
+
+#define CHECK(cond, ...)											\
+	do {															\
+		checks++;													\
+		if (!(cond)) {												\
+			failures++;												\
+			fprintf(TEST_FD, "%s:%d: ", __FILE__, __LINE__);		\
+			fprintf(TEST_FD, __VA_ARGS__);							\
+			fprintf(TEST_FD, "\n");									\
+		}															\
+	} while (0)
+
+
+static int64_t test_timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * SEC_TO_NANOSEC + ts->tv_nsec;
+}
+
+/* Starts at step 0, ends at step steps, and never goes backwards */
+static void test_interpolate(void)
+{
+	static const int32_t levels[] = {0, 1, CURVE_ONE / 3, CURVE_ONE - 1, CURVE_ONE};
+	static const unsigned int steps[] = {1, 2, 3, 7, 20, 21, 200};
+	unsigned int a, b, s, step;
+	int32_t from, to, level, prev;
+
+	for (a = 0; a < ARRAY_SIZE(levels); a++) {
+		for (b = 0; b < ARRAY_SIZE(levels); b++) {
+			for (s = 0; s < ARRAY_SIZE(steps); s++) {
+				from = levels[a];
+				to = levels[b];
+				prev = fader_interpolate(from, to, 0, steps[s]);
+				CHECK(prev == from, "interpolate %d->%d/%u: step 0 is %d", from, to, steps[s], prev);
+
+				for (step = 1; step <= steps[s]; step++) {
+					level = fader_interpolate(from, to, step, steps[s]);
+					CHECK(to >= from ? level >= prev : level <= prev,
+						  "interpolate %d->%d/%u: step %u went back from %d to %d", from, to, steps[s], step, prev, level);
+					prev = level;
+				}
+				CHECK(prev == to, "interpolate %d->%d/%u: ended on %d", from, to, steps[s], prev);
+			}
+		}
+	}
+
+	return;
+}
+
+/* Every fade takes exactly steps steps, angles never go backwards
+ * nor outside of start and final ones, and last step is exactly final
+ */
+static void test_step(struct triac_status *triac)
+{
+	static const unsigned int times[] = TEST_TIMES;
+	static const unsigned int angles[] = TEST_ANGLES;
+	unsigned int curve, t, a, b, taken, expected;
+	unsigned int prev_pos, prev_neg;
+	bool done;
+
+	for (curve = 0; curve < CURVE_COUNT; curve++) {
+		for (t = 0; t < ARRAY_SIZE(times); t++) {
+			for (a = 0; a < ARRAY_SIZE(angles); a++) {
+				for (b = 0; b < ARRAY_SIZE(angles); b++) {
+					/* Negative half cycle fades the other way round */
+					triac[0].phase.pos = angles[a];
+					triac[0].phase.neg = angles[b];
+					fader_start(0, times[t], angles[b], angles[a], curve);
+
+					expected = (times[t] + FADER_STEP_MS / 2) / FADER_STEP_MS;
+					if (!expected)
+						expected = 1;
+					CHECK(fader[0].steps == expected, "curve %u, %ums: %u steps, expected %u", curve, times[t], fader[0].steps, expected);
+
+					prev_pos = triac[0].phase.pos;
+					prev_neg = triac[0].phase.neg;
+					taken = 0;
+					do {
+						triac[0].phase.refresh = false;
+						done = fader_step(&fader[0]);
+						taken++;
+						CHECK(triac[0].phase.refresh, "curve %u, %ums: step %u not refreshed", curve, times[t], taken);
+						CHECK(angles[b] >= angles[a] ? triac[0].phase.pos >= prev_pos && triac[0].phase.pos <= angles[b]
+													 : triac[0].phase.pos <= prev_pos && triac[0].phase.pos >= angles[b],
+							  "curve %u, %ums, pos %u->%u: step %u went from %u to %u",
+							  curve, times[t], angles[a], angles[b], taken, prev_pos, triac[0].phase.pos);
+						CHECK(angles[a] >= angles[b] ? triac[0].phase.neg >= prev_neg && triac[0].phase.neg <= angles[a]
+													 : triac[0].phase.neg <= prev_neg && triac[0].phase.neg >= angles[a],
+							  "curve %u, %ums, neg %u->%u: step %u went from %u to %u",
+							  curve, times[t], angles[b], angles[a], taken, prev_neg, triac[0].phase.neg);
+						prev_pos = triac[0].phase.pos;
+						prev_neg = triac[0].phase.neg;
+					} while (!done && taken < expected + 1);
+
+					CHECK(done && taken == expected, "curve %u, %ums: finished after %u steps, expected %u", curve, times[t], taken, expected);
+					CHECK(triac[0].phase.pos == angles[b] && triac[0].phase.neg == angles[a],
+						  "curve %u, %ums: ended on %u/%u, expected %u/%u",
+						  curve, times[t], triac[0].phase.pos, triac[0].phase.neg, angles[b], angles[a]);
+					fader_stop(0);
+				}
+			}
+		}
+	}
+
+	return;
+}
+
+/* Every step deadline is counted from fade start, so steps are evenly
+ * spaced (within a ns of rounding) and last one is exactly fade time
+ * after start, with nanoseconds carried into seconds
+ */
+static void test_deadline(void)
+{
+	static const unsigned int times[] = TEST_TIMES;
+	struct triac_fade fade;
+	int64_t start_ns, deadline_ns, prev_ns, spacing_ns;
+	unsigned int t;
+
+	for (t = 0; t < ARRAY_SIZE(times); t++) {
+		memset(&fade, 0, sizeof(fade));
+		fade.start.tv_sec = 100;
+		fade.start.tv_nsec = SEC_TO_NANOSEC - 10;
+		fade.time = times[t];
+		fade.steps = (times[t] + FADER_STEP_MS / 2) / FADER_STEP_MS;
+		if (!fade.steps)
+			fade.steps = 1;
+
+		start_ns = test_timespec_ns(&fade.start);
+		prev_ns = start_ns;
+		spacing_ns = (int64_t)times[t] * MSEC_TO_NANOSEC / fade.steps;
+
+		for (fade.step = 0; fade.step < fade.steps; fade.step++) {
+			fader_set_deadline(&fade);
+			deadline_ns = test_timespec_ns(&fade.deadline);
+
+			CHECK(fade.deadline.tv_nsec >= 0 && fade.deadline.tv_nsec < SEC_TO_NANOSEC,
+				  "%ums: step %u deadline tv_nsec %ld not normalized", times[t], fade.step, fade.deadline.tv_nsec);
+			CHECK(deadline_ns - prev_ns >= spacing_ns && deadline_ns - prev_ns <= spacing_ns + 1,
+				  "%ums: step %u spaced %lldns, expected %lldns", times[t], fade.step,
+				  (long long)(deadline_ns - prev_ns), (long long)spacing_ns);
+			prev_ns = deadline_ns;
+		}
+
+		CHECK(prev_ns - start_ns == (int64_t)times[t] * MSEC_TO_NANOSEC,
+			  "%ums: last deadline %lldns after start", times[t], (long long)(prev_ns - start_ns));
+	}
+
+	return;
+}
+
+int main(void)
+{
+	struct triac_status triac;
+
+	memset(&triac, 0, sizeof(triac));
+	fader_init(&triac, 1);
+	if (fader == NULL) {
+		fprintf(TEST_FD, "fadertest: out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	/* fader_start() and fader_stop() chatter goes to stdout */
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		fprintf(TEST_FD, "fadertest: could not silence fader messages\n");
+
+	test_interpolate();
+	test_step(&triac);
+	test_deadline();
+
+	fader_release();
+
+	fprintf(TEST_FD, "fadertest: %u checks, %u failed\n", checks, failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/*
+ * gentables.c - fade curve table generator
+ * Runs at build time and prints tables.c on stdout, so triacd
+ * looks curves up instead of computing them.
+ *
+ * Copyright (C) 2019 Victor Preatoni
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tables.h"
+
+
+/* Curve level (0-1) for a conduction angle in degrees.
+ * Phase controlled sine conducting alpha radians per half cycle:
+ * 		power = (alpha - sin(2 * alpha) / 2) / PI
+ * 		rms = sqrt(power)
+ * 		mean = (1 - cos(alpha)) / 2
+ */
+static double curve_function(int curve, double angle)
+{
+	double alpha = angle * M_PI / CURVE_MAX_ANGLE;
+	double power = (alpha - sin(2 * alpha) / 2) / M_PI;
+	
+	if (power < 0)
+		power = 0;
+	
+	switch (curve) {
+		case CURVE_RMS:
+			return sqrt(power);
+		case CURVE_POWER:
+			return power;
+		case CURVE_GAMMA:
+			return pow(power, 1 / CURVE_GAMMA_EXP);
+		case CURVE_MEAN:
+			return (1 - cos(alpha)) / 2;
+		case CURVE_LINEAR:
+		default:
+			return angle / CURVE_MAX_ANGLE;
+	}
+}
+
+/* Inverse of curve_function(), by bisection. Every curve is monotonic */
+static double curve_inverse(int curve, double level)
+{
+	double low = 0, high = CURVE_MAX_ANGLE, mid;
+	int i;
+	
+	for (i = 0; i < 64; i++) {
+		mid = (low + high) / 2;
+		if (curve_function(curve, mid) < level)
+			low = mid;
+		else
+			high = mid;
+	}
+	
+	return (low + high) / 2;
+}
+
+static unsigned long fixed(double x)
+{
+	return (unsigned long)lround(x * CURVE_ONE);
+}
+
+int main(void)
+{
+	const char *names[] = CURVE_NAMES;
+	int curve, i;
+	
+	printf("/* Generated by gentables.c, do not edit */\n\n");
+	printf("#include \"tables.h\"\n\n");
+	
+	printf("const uint32_t curve_level[CURVE_COUNT][CURVE_MAX_ANGLE + 1] = {\n");
+	for (curve = 0; curve < CURVE_COUNT; curve++) {
+		printf("\t/* %s */\n\t{", names[curve]);
+		for (i = 0; i <= CURVE_MAX_ANGLE; i++)
+			printf("%s%lu", (i % 8) ? ", " : (i ? ",\n\t\t" : ""), fixed(curve_function(curve, i)));
+		printf("},\n");
+	}
+	printf("};\n\n");
+	
+	printf("const uint32_t curve_angle[CURVE_COUNT][CURVE_POINTS + 1] = {\n");
+	for (curve = 0; curve < CURVE_COUNT; curve++) {
+		printf("\t/* %s */\n\t{", names[curve]);
+		for (i = 0; i <= CURVE_POINTS; i++)
+			printf("%s%lu", (i % 8) ? ", " : (i ? ",\n\t\t" : ""), fixed(curve_inverse(curve, (double)i / CURVE_POINTS)));
+		printf("},\n");
+	}
+	printf("};\n");
+	
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+#ifndef ACLINE_H
+#define ACLINE_H
+
+/* Interface exported by aclinedrv.ko to other Kernel modules
+ */
+
+#include <linux/ktime.h>
+#include <linux/kobject.h>
+
+/* AC line timing, all of it from the same zero crossing */
+struct acline_snapshot {
+	/* Zero crossing timestamp, filtered while tracking filter is locked */
+	ktime_t sync;
+	/* Predicted next zero crossing, 0 if tracking filter is not locked.
+	 * Does not move on edges rejected as noise. triacdrv plans cycles
+	 * whose edge was rejected or went missing from it
+	 */
+	ktime_t next;
+	/* Mains period, 0 if out of bounds */
+	unsigned int period_ns;
+	/* Optocoupler hysteresis, rising edge comes this early */
+	unsigned int optohyst_ns;
+};
+
+/* Called from IRQ context on every accepted zero crossing */
+typedef void (*acline_callback_t)(void);
+
+/* Lock-free, never disables interrupts. Safe from IRQ context */
+extern void acline_get_snapshot(struct acline_snapshot *snapshot);
+extern unsigned int acline_get_period(void);
+extern unsigned int acline_get_optohyst(void);
+extern int acline_register_callback(acline_callback_t callback);
+extern void acline_unregister_callback(acline_callback_t callback);
+extern unsigned int acline_get_irq(void);
+extern struct kobject * acline_get_kobject(void);
+extern int acline_get_batch_hold(void);
+
+#endif // ACLINE_H
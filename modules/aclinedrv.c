@@ -9,9 +9,11 @@
  * phase control mechanisms.
  * 
  * Module continuously measures mains period with nanosecond precision
- * for a precise phase control of TRIACs.
+ * for a precise phase control of TRIACs. A tracking filter smooths
+ * period, predicts next zero crossing and rejects noisy edges.
  * 
- * It provides frequency measurement on a sysfs export
+ * It provides frequency measurement on a sysfs export, and a history
+ * of recent zero crossings streamed thru /dev/acline
  *
  * Copyright (C) 2019 Victor Preatoni
  */
@@ -23,38 +25,36 @@
  * critical data from another Kernel module
  */
 
-/* timestamp for AC mains zero crossing */
-ktime_t acline_get_sync_timestamp(void)
+/* Consistent AC mains timing of last zero crossing: timestamp,
+ * predicted next one, period and optocoupler hysteresis.
+ * Retries if IRQ handler updated it meanwhile, instead of
+ * blocking it
+ */
+void acline_get_snapshot(struct acline_snapshot *snapshot)
 {
-	ktime_t local_timestamp;
+	unsigned int seq;
 	
-	spin_lock_irqsave(&acline_phase.lock, acline_phase.spin_flags);
-	local_timestamp = acline_phase.timestamp;
-	spin_unlock_irqrestore(&acline_phase.lock, acline_phase.spin_flags);
+	do {
+		seq = read_seqcount_begin(&acline_phase.seq);
+		*snapshot = acline_phase.snapshot;
+	} while (read_seqcount_retry(&acline_phase.seq, seq));
 	
-	return local_timestamp;
+	return;
 }
-EXPORT_SYMBOL(acline_get_sync_timestamp);
+EXPORT_SYMBOL(acline_get_snapshot);
 
 
-/* period (in ns) of AC mains
+/* period (in ns) of AC mains. Filtered one while tracking
+ * filter is locked, raw one otherwise.
  * If period is out of bounds, returns 0
  */
 unsigned int acline_get_period(void)
 {
-	ktime_t local_period_time;
-	unsigned int period_ns;
+	struct acline_snapshot snapshot;
 	
-	spin_lock_irqsave(&acline_phase.lock, acline_phase.spin_flags);
-	local_period_time = acline_phase.period_time;
-	spin_unlock_irqrestore(&acline_phase.lock, acline_phase.spin_flags);
+	acline_get_snapshot(&snapshot);
 	
-	period_ns = (unsigned int)ktime_to_ns(local_period_time);
-	/* Limit calculation to normal mains Hz boundary */
-	if (period_ns > MIN_PERIOD_ns && period_ns < MAX_PERIOD_ns)
-		return period_ns;
-	else
-		return 0;
+	return snapshot.period_ns;
 }
 EXPORT_SYMBOL(acline_get_period);
 
@@ -64,10 +64,43 @@ EXPORT_SYMBOL(acline_get_period);
  */
 unsigned int acline_get_optohyst(void)
 {
-	return calibration.opto_hysteresis;
+	struct acline_snapshot snapshot;
+	
+	acline_get_snapshot(&snapshot);
+	
+	return snapshot.optohyst_ns;
 }
 EXPORT_SYMBOL(acline_get_optohyst);
 
+/* Registers a function called on every accepted zero crossing,
+ * from IRQ context, right after timing snapshot is updated
+ */
+int acline_register_callback(acline_callback_t callback)
+{
+	unsigned int i;
+	
+	for (i = 0; i < ACLINE_MAX_CALLBACKS; i++)
+		if (!cmpxchg(&callbacks[i], NULL, callback))
+			return 0;
+	
+	return -EBUSY;
+}
+EXPORT_SYMBOL(acline_register_callback);
+
+/* Once it returns, callback is not running and will not be called again */
+void acline_unregister_callback(acline_callback_t callback)
+{
+	unsigned int i;
+	
+	for (i = 0; i < ACLINE_MAX_CALLBACKS; i++)
+		cmpxchg(&callbacks[i], callback, NULL);
+	
+	synchronize_irq(irqNumber);
+	
+	return;
+}
+EXPORT_SYMBOL(acline_unregister_callback);
+
 /* Returns irq number used to syncronize
  * TRIACs on zero-crossing phase
  */
@@ -88,6 +121,16 @@ struct kobject * acline_get_kobject(void)
 EXPORT_SYMBOL(acline_get_kobject);
 
 
+/* Returns batch window state latched on last zero crossing.
+ * While set, TRIACs must keep their previous phase angles
+ */
+int acline_get_batch_hold(void)
+{
+	return atomic_read(&batch.latched);
+}
+EXPORT_SYMBOL(acline_get_batch_hold);
+
+
 
 /* SYSFS section to allow reading AC mains
  * frequency from user-mode
@@ -97,7 +140,8 @@ static int acline_sysfs_start(void)
 	acline_kobject = kobject_create_and_add(SYSFS_NODE, NULL);
 
 	if (acline_kobject) {
-		if (sysfs_create_file(acline_kobject, &sysfs.attr)) {
+		if (sysfs_create_file(acline_kobject, &sysfs.attr) || sysfs_create_file(acline_kobject, &sysfs_batch.attr) ||
+			sysfs_create_file(acline_kobject, &sysfs_optohyst.attr)) {
 			printk(KERN_ERR "AC LINE: failed to create sysfs\n");
 			return -EIO;
 		}
@@ -123,15 +167,9 @@ static ssize_t acline_get_freq(struct kobject *kobj, struct kobj_attribute *attr
 	/* Frequency is stored times 100 to allow fixed point arithmetics */
 	unsigned int freqx100, freq, freqdecimals;
 	unsigned int period_ns;
-	ktime_t local_period_time;
 	
-	spin_lock_irqsave(&acline_phase.lock, acline_phase.spin_flags);
-	local_period_time = acline_phase.period_time;
-	spin_unlock_irqrestore(&acline_phase.lock, acline_phase.spin_flags);
-	
-	period_ns = (unsigned int)ktime_to_ns(local_period_time);
-	/* Limit calculation to normal mains Hz boundary */
-	if (period_ns > MIN_PERIOD_ns && period_ns < MAX_PERIOD_ns)
+	period_ns = acline_get_period();
+	if (period_ns)
 		freqx100 = SEC_TO_NANOSEC / (period_ns / 100);
 	else
 		freqx100 = 0;
@@ -148,132 +186,289 @@ static ssize_t acline_get_freq(struct kobject *kobj, struct kobj_attribute *attr
 }
 
 
-
-/* IRQ handlers section. Due to the high precision needed for period
- * calculations, AC mains signal must be processed by interrupt routines
+/* Live optocoupler hysteresis. Default or cached one is flagged
+ * until first background calibration succeeds
  */
+static ssize_t acline_get_optohyst_sysfs(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+	const char *flag = "";
+	
+	if (!READ_ONCE(calibration.windows))
+		flag = calibration.cached ? " (cached)" : " (default)";
+	
+	return scnprintf(buff, PAGE_SIZE, "%uus%s\n", acline_get_optohyst() / USEC_TO_NANOSEC, flag);
+}
+
 
-static u64 int_pow(u64 base, unsigned int exp)
+/* Batch window writer. "1" opens window, "0" commits it */
+static ssize_t acline_set_batch(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
 {
-	u64 result = 1;
+	unsigned int hold;
 	
-	while (exp) {
-		if (exp & 1)
-			result *= base;
-		exp >>= 1;
-		base *= base;
+	if (kstrtouint(buff, 10, &hold) || hold > 1) {
+		printk(KERN_ERR "AC LINE: wrong batch parameter\n");
+		return -EINVAL;
 	}
 	
-	return result;
+	atomic_set(&batch.hold, hold);
+	
+	return count;
 }
 
-/* AC mains optocoupler requires the use of high value series resistors to avoid
- * burning it's LED due to high voltage (311V peak on 220V RMS). This high
- * resistor value causes LED to prematurely turn off before AC mains actually
- * reaches it's zero-crossing point. This effect causes an assymetry on the
- * positive and negative cycles of the "squared" AC mains signal. It can be
- * easyly calibrated averaging positive cycles time and negative cycles time,
- * and then substracting each other and dividing value by 4.
- * This function launches and IRQ handler to measure rising and falling edge
- * times, waits for CALIB_TIME_MS time, disables interrupt, and makes
- * calculations.
+static ssize_t acline_get_batch(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+	return scnprintf(buff, PAGE_SIZE, "%d\n", atomic_read(&batch.hold));
+}
+
+
+/* Publishes last zero crossing for acline_get_snapshot() readers.
+ * Called from IRQ handler, or before it is installed
  */
-static int acline_irq_calibrate(void)
+static void acline_publish(void)
 {
-	unsigned int i;
-	unsigned int accum;
-	unsigned int avg_pos, avg_neg;
-	unsigned int std_pos, std_neg;
+	struct acline_snapshot *snapshot = &acline_phase.snapshot;
 	
-	irqNumber = gpio_to_irq(opto_input);
-	calibration.samples_pos = 0;
-	calibration.samples_neg = 0;
-	acline_phase.timestamp = 0;
+	write_seqcount_begin(&acline_phase.seq);
+	snapshot->sync = acline_phase.pll.locked ? acline_phase.pll.sync : acline_phase.timestamp;
+	snapshot->next = acline_phase.pll.locked ? acline_phase.pll.next : 0;
+	/* Limited to normal mains Hz boundary */
+	snapshot->period_ns = timing_period(&acline_phase.pll, acline_phase.period_time);
+	snapshot->optohyst_ns = calibration.opto_hysteresis;
+	write_seqcount_end(&acline_phase.seq);
 	
-	if (request_irq(irqNumber, (irq_handler_t)acline_calibration_irq_handler, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "calibrateAC", (void *)(acline_calibration_irq_handler)))
-		printk(KERN_ERR "IRQ %d: could not request\n", irqNumber);
-	else {
-		msleep(CALIB_TIME_MS);
-		free_irq(irqNumber, (void *)(acline_calibration_irq_handler));
+	if (snapshot->period_ns && acline_phase.pll.locked)
+		WRITE_ONCE(cached_period, snapshot->period_ns);
+	
+	return;
+}
+
+
+/* Zero crossing ring buffer section. Every slot has its own
+ * sequence number, invalidated while IRQ rewrites it, so readers
+ * never need a lock shared with the IRQ handler
+ */
+static void acline_ring_push(ktime_t timestamp, ktime_t period)
+{
+	unsigned long head = ring.head;
+	struct acline_slot *slot = &ring.slot[head & RING_MASK];
+	s64 period_ns = ktime_to_ns(period);
+	
+	WRITE_ONCE(slot->seq, ULONG_MAX);
+	smp_wmb();
+	slot->sample.timestamp_ns = ktime_to_ns(timestamp);
+	/* First sample has no previous crossing */
+	slot->sample.period_ns = (period_ns > 0 && period_ns < U32_MAX) ? period_ns : 0;
+	slot->sample.lost = 0;
+	smp_store_release(&slot->seq, head);
+	smp_store_release(&ring.head, head + 1);
+	
+	wake_up_interruptible(&ring.wq);
+	
+	return;
+}
+
+/* Takes reader next sample. Slots overwritten before reader got them
+ * are accounted on sample lost field.
+ * Returns false if there is no new sample
+ */
+static bool acline_ring_get(struct acline_reader *reader, struct acline_sample *sample)
+{
+	struct acline_slot *slot;
+	unsigned long head, seq;
+	unsigned long lost = 0;
+	
+	for (;;) {
+		head = smp_load_acquire(&ring.head);
+		if (reader->pos == head)
+			return false;
 		
-		/* Only process data if we have some measurements */
-		if (calibration.samples_pos && calibration.samples_neg) {
-			for (i = 0, accum = 0; i < calibration.samples_pos; i++)
-				accum += ktime_to_ns(calibration.period_pos[i]);
-			avg_pos = accum / i;
-			
-			for (i = 0, accum = 0; i < calibration.samples_pos; i++)
-				accum += int_pow((ktime_to_ns(calibration.period_pos[i]) - avg_pos), 2);
-			std_pos = int_sqrt(accum / i);
-			
-			for (i = 0, accum = 0; i < calibration.samples_neg; i++)
-				accum += ktime_to_ns(calibration.period_neg[i]);
-			avg_neg = accum / i;
-			
-			for (i = 0, accum = 0; i < calibration.samples_neg; i++)
-				accum += int_pow((ktime_to_ns(calibration.period_neg[i]) - avg_neg), 2);
-			std_neg = int_sqrt(accum / i);
-			
-			/* If standard deviation is below some reasonable value (50us)
-			 * we can now calculate the optocoupler hysteresis
-			 */
-			if (std_neg < (50 * USEC_TO_NANOSEC) && std_pos < (50 * USEC_TO_NANOSEC)) {
-// 				printk(KERN_INFO "stdev: %u %u\n", std_pos, std_neg);
-				calibration.opto_hysteresis = (avg_neg - avg_pos) / 4;
-				return 0; /* IRQ calibrated */
-			}
+		/* IRQ went a whole lap ahead of us */
+		if (head - reader->pos > RING_SIZE) {
+			lost += head - RING_SIZE - reader->pos;
+			reader->pos = head - RING_SIZE;
 		}
+		
+		slot = &ring.slot[reader->pos & RING_MASK];
+		seq = smp_load_acquire(&slot->seq);
+		*sample = slot->sample;
+		smp_rmb();
+		if (seq == reader->pos && READ_ONCE(slot->seq) == seq)
+			break;
+		
+		/* Overwritten while we were reading it */
+		lost++;
+		reader->pos++;
+	}
+	
+	reader->pos++;
+	sample->lost = min_t(unsigned long, lost, U32_MAX);
+	if (lost) {
+		reader->lost += lost;
+		atomic64_add(lost, &ring.total_lost);
 	}
 	
-	return -1;
+	return true;
 }
 
-/* Calibration IRQ handler. Will only run for a few secs and then
- * IRQ is released
- */
-static irq_handler_t acline_calibration_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs)
+/* Readers start from oldest sample still on ring buffer */
+static int acline_dev_open(struct inode *inode, struct file *file)
 {
-	/* First run */
-	if (!acline_phase.timestamp)
-		acline_phase.timestamp = ktime_get();
-	else {
-		/* Avoid overflowing buffer if it is full */
-		if (calibration.samples_pos < CALIB_BUFFER_LENGTH && calibration.samples_neg < CALIB_BUFFER_LENGTH) {
-			if (gpio_get_value(opto_input)) {
-				acline_phase.old_timestamp = acline_phase.timestamp;
-				acline_phase.timestamp = ktime_get();
-				calibration.period_pos[calibration.samples_pos] = ktime_to_ns(ktime_sub(acline_phase.timestamp, acline_phase.old_timestamp));
-				calibration.samples_pos ++;
-			}
-			else {
-				acline_phase.old_timestamp = acline_phase.timestamp;
-				acline_phase.timestamp = ktime_get();
-				calibration.period_neg[calibration.samples_neg] = ktime_to_ns(ktime_sub(acline_phase.timestamp, acline_phase.old_timestamp));
-				calibration.samples_neg ++;
-			}
-// 			printk(KERN_INFO "calib: %u %u\n", calibration.samples_pos, calibration.samples_neg);
+	struct acline_reader *reader;
+	unsigned long head = smp_load_acquire(&ring.head);
+	
+	reader = kzalloc(sizeof(struct acline_reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	
+	mutex_init(&reader->lock);
+	reader->pos = (head > RING_SIZE) ? head - RING_SIZE : 0;
+	file->private_data = reader;
+	
+	/* A stream, there is no file position to seek to */
+	return stream_open(inode, file);
+}
+
+static int acline_dev_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+/* Blocks until at least one sample is available, unless O_NONBLOCK */
+static ssize_t acline_dev_read(struct file *file, char __user *buff, size_t count, loff_t *ppos)
+{
+	struct acline_reader *reader = file->private_data;
+	struct acline_sample samples[READ_CHUNK];
+	size_t done = 0;
+	unsigned int n;
+	
+	if (count < sizeof(struct acline_sample))
+		return -EINVAL;
+	
+	if (file->f_flags & O_NONBLOCK) {
+		if (smp_load_acquire(&ring.head) == READ_ONCE(reader->pos))
+			return -EAGAIN;
+	}
+	else if (wait_event_interruptible(ring.wq, smp_load_acquire(&ring.head) != READ_ONCE(reader->pos)))
+		return -ERESTARTSYS;
+	
+	mutex_lock(&reader->lock);
+	while (count - done >= sizeof(struct acline_sample)) {
+		for (n = 0; n < READ_CHUNK && count - done - n * sizeof(struct acline_sample) >= sizeof(struct acline_sample); n++)
+			if (!acline_ring_get(reader, &samples[n]))
+				break;
+		if (!n)
+			break;
+		if (copy_to_user(buff + done, samples, n * sizeof(struct acline_sample))) {
+			mutex_unlock(&reader->lock);
+			return done ? done : -EFAULT;
 		}
+		done += n * sizeof(struct acline_sample);
+	}
+	mutex_unlock(&reader->lock);
+	
+	return done;
+}
+
+static __poll_t acline_dev_poll(struct file *file, poll_table *wait)
+{
+	struct acline_reader *reader = file->private_data;
+	
+	poll_wait(file, &ring.wq, wait);
+	
+	if (smp_load_acquire(&ring.head) != READ_ONCE(reader->pos))
+		return EPOLLIN | EPOLLRDNORM;
+	
+	return 0;
+}
+
+static long acline_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct acline_reader *reader = file->private_data;
+	struct acline_stats stats;
+	
+	switch (cmd) {
+	case ACLINE_IOC_STATS:
+		stats.samples = smp_load_acquire(&ring.head);
+		stats.lost = READ_ONCE(reader->lost);
+		stats.total_lost = atomic64_read(&ring.total_lost);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+		
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int acline_dev_start(void)
+{
+	init_waitqueue_head(&ring.wq);
+	
+	if (misc_register(&acline_dev)) {
+		printk(KERN_ERR "AC LINE: cannot register %s\n", ACLINE_DEVICE);
+		return -EIO;
 	}
 	
-	return (irq_handler_t)IRQ_HANDLED;
+	return 0;
+}
+
+static void acline_dev_end(void)
+{
+	misc_deregister(&acline_dev);
+	return;
+}
+
+
+/* IRQ handlers section. Due to the high precision needed for period
+ * calculations, AC mains signal must be processed by interrupt routines
+ */
+
+/* Optocoupler calibration section.
+ * AC mains optocoupler requires the use of high value series resistors to avoid
+ * burning it's LED due to high voltage (311V peak on 220V RMS). This high
+ * resistor value causes LED to prematurely turn off before AC mains actually
+ * reaches it's zero-crossing point. This effect causes an assymetry on the
+ * positive and negative cycles of the "squared" AC mains signal. It can be
+ * easyly calibrated averaging positive cycles time and negative cycles time,
+ * and then substracting each other and dividing value by 4.
+ * Both edges are measured continuously from IRQ handler. Mean and variance
+ * are updated on every edge (Welford), and every CALIB_WINDOW samples
+ * hysteresis is refreshed if both cycles were stable enough, so it follows
+ * optocoupler as it warms up. Math is shared with triacsim, on timing.h
+ */
+static void acline_calib_window(void)
+{
+	if (!timing_calib_window(&calibration.high, &calibration.low, &calibration.opto_hysteresis))
+		return;
+	
+	if (!calibration.windows++)
+		printk(KERN_INFO "AC LINE: optocoupler hysteresis = %uus%s\n", calibration.opto_hysteresis / USEC_TO_NANOSEC,
+			   calibration.cached ? ", cache confirmed" : "");
+	acline_publish();
+	
+	return;
 }
 
-/* Standard IRQ routine that will install handler on RISING edge only.
+/* Standard IRQ routine that will install handler on both edges.
  * The RISING edge trigger occurs BEFORE AC mains reaches zero, so
  * it is very usefull, as we have calibration.opto_hysteresis nanoseconds
  * of grace time to perform some complex calculations before we start doing
- * something else (like triggering TRIACs)
+ * something else (like triggering TRIACs). FALLING edge is only used
+ * for calibration.
  */
 static int acline_irq_start(void)
 {   
 	irqNumber = gpio_to_irq(opto_input);
+	seqcount_init(&acline_phase.seq);
+	timing_pll_reset(&acline_phase.pll);
+	acline_publish();
 	
-	if (request_irq(irqNumber, (irq_handler_t)acline_gpio_irq_handler, IRQF_TRIGGER_RISING | IRQF_SHARED, "lineAC", (void *)(acline_gpio_irq_handler))) {
+	if (request_irq(irqNumber, (irq_handler_t)acline_gpio_irq_handler, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "lineAC", (void *)(acline_gpio_irq_handler))) {
 		printk(KERN_ERR "IRQ %d: could not request\n", irqNumber);
 		return -EIO;
 	}
 	else {
-		spin_lock_init(&acline_phase.lock);
 		return 0;
 	}
 }
@@ -284,13 +479,51 @@ static void acline_irq_end(void)
 	return;
 }
 
-/* Very simple IRQ handler that will precisely calculate period time */
+/* Very simple IRQ handler that will precisely calculate period time.
+ * Raw rising edges always go to ring buffer, rejected ones do not
+ * start a new cycle. Accepted ones are handed to registered
+ * zero crossing callbacks (eg: triacdrv)
+ */
 static irq_handler_t acline_gpio_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs)
 {
+	ktime_t now;
+	bool accepted;
+	acline_callback_t callback;
+	unsigned int i;
+	
 	if (dev_id == (void *)(acline_gpio_irq_handler)) {
+		now = ktime_get();
+		
+		/* Falling edge ends optocoupler high time */
+		if (!gpio_get_value(opto_input)) {
+			timing_calib_add(&calibration.high, ktime_sub(now, acline_phase.timestamp));
+			calibration.falling = now;
+			return (irq_handler_t)IRQ_HANDLED;
+		}
+		
 		acline_phase.old_timestamp = acline_phase.timestamp;
-		acline_phase.timestamp = ktime_get();
+		acline_phase.timestamp = now;
 		acline_phase.period_time = ktime_sub(acline_phase.timestamp, acline_phase.old_timestamp);
+		accepted = timing_pll_update(&acline_phase.pll, acline_phase.timestamp, acline_phase.period_time, cached_period);
+		if (accepted)
+			acline_publish();
+		
+		acline_ring_push(acline_phase.timestamp, acline_phase.period_time);
+		
+		if (accepted) {
+			/* Rising edge ends optocoupler low time */
+			timing_calib_add(&calibration.low, ktime_sub(now, calibration.falling));
+			acline_calib_window();
+			
+			/* TRIAC threads for this cycle will all see the same value */
+			atomic_set(&batch.latched, atomic_read(&batch.hold));
+			
+			for (i = 0; i < ACLINE_MAX_CALLBACKS; i++) {
+				callback = READ_ONCE(callbacks[i]);
+				if (callback)
+					callback();
+			}
+		}
 		return (irq_handler_t)IRQ_HANDLED;
 	}
 	else
@@ -335,15 +568,20 @@ static int __init acline_init(void)
 	err = acline_sysfs_start();
 	if (err)
 		goto fail_sysfs;
-		
-	printk(KERN_INFO "AC LINE: calibrating...\n");
-	if (acline_irq_calibrate()) {
-		printk(KERN_ERR "AC LINE: unstable frequency\n");
-		calibration.opto_hysteresis = DEFAULT_OPTO_HYSTERESIS;
+	
+	err = acline_dev_start();
+	if (err)
+		goto fail_dev;
+	
+	/* Refined in background, see /sys/triacd/optohyst */
+	if (cached_optohyst >= MIN_OPTO_HYSTERESIS_us && cached_optohyst <= MAX_OPTO_HYSTERESIS_us) {
+		calibration.opto_hysteresis = cached_optohyst * USEC_TO_NANOSEC;
+		calibration.cached = true;
+		printk(KERN_INFO "AC LINE: cached optocoupler hysteresis = %uus\n", cached_optohyst);
 	}
 	else
-		printk(KERN_INFO "AC LINE: optocoupler hysteresis = %uus\n", calibration.opto_hysteresis / USEC_TO_NANOSEC);
-		
+		calibration.opto_hysteresis = DEFAULT_OPTO_HYSTERESIS;
+	
 	err = acline_irq_start();
 	if (err)
 		goto fail_irq;
@@ -352,7 +590,8 @@ static int __init acline_init(void)
 	return 0;
 	
 	
-	fail_irq:		acline_sysfs_end();
+	fail_irq:		acline_dev_end();
+	fail_dev:		acline_sysfs_end();
 	fail_sysfs:		acline_gpio_end();
 	fail_gpio:		printk(KERN_ERR "AC LINE: failed to initialize\n");
 					return err;
@@ -361,6 +600,7 @@ static int __init acline_init(void)
 static void __exit acline_exit(void)
 {
 	acline_irq_end();
+	acline_dev_end();
 	acline_sysfs_end();
 	acline_gpio_end();
 	
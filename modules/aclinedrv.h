@@ -6,7 +6,7 @@
 #include <linux/delay.h>
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
-#include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/hrtimer.h>
 #include <linux/ktime.h>
 #include <linux/kernel.h>
@@ -14,11 +14,23 @@
 #include <linux/sysfs.h>
 #include <linux/device.h>
 #include <linux/moduleparam.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+
+#include "acline.h"
+#include "aclinedrv_ioctl.h"
+#include "timing.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Victor Preatoni");
 MODULE_DESCRIPTION("OpenIndoor Optocoupler phase feedback driver");
-MODULE_VERSION("0.1");
+MODULE_VERSION("0.2");
 
 static const struct of_device_id triac_of_match[] = {
 	{ .compatible = "triacboard,quadtriac,dualtriac", },
@@ -34,70 +46,150 @@ static unsigned int opto_input = 5;
 module_param(opto_input, uint, 0);
 MODULE_PARM_DESC(opto_input, "Sets ARM GPIO pin number used to read phase feedback input. GPIO5 by default.");
 
-/* Time conversion constants */
-#define SEC_TO_MSEC				1000U
-#define USEC_TO_NANOSEC			1000U
-#define MSEC_TO_NANOSEC			(1000U * USEC_TO_NANOSEC)
-#define SEC_TO_NANOSEC			(1000U * MSEC_TO_NANOSEC)
+/* Calibration saved by triacd on a previous run, so TRIACs can be
+ * triggered right away. Hysteresis is confirmed in background.
+ * period is kept updated with filtered mains period, to be read back
+ * from /sys/module/aclinedrv/parameters/period
+ * eg: insmod aclinedrv.ko optohyst=289 period=20000000
+ */
+static unsigned int cached_optohyst = 0;
+module_param_named(optohyst, cached_optohyst, uint, 0444);
+MODULE_PARM_DESC(optohyst, "Sets cached optocoupler hysteresis in microseconds. MIN=1 MAX=2000, 0 (default) to start from 320us.");
+
+static unsigned int cached_period = 0;
+module_param_named(period, cached_period, uint, 0444);
+MODULE_PARM_DESC(period, "Sets cached AC mains period in nanoseconds, used to lock on first zero crossing. 0 by default.");
 
 /* sysfs entry node */
 #define SYSFS_NODE  "triacd"
 #define SYSFS_OBJECT  freq
+#define SYSFS_BATCH_OBJECT  batch
+#define SYSFS_OPTOHYST_OBJECT  optohyst
 
-/* Minimum accepted frequency */
-#define MIN_FREQUENCY			40U //Hz
-/* Maximum accepted frequency */
-#define MAX_FREQUENCY			70U //Hz
-/* Minimum accepted period */
-#define MIN_PERIOD_ns			(SEC_TO_NANOSEC / MAX_FREQUENCY)
-/* Maximum accepted period */
-#define MAX_PERIOD_ns			(SEC_TO_NANOSEC / MIN_FREQUENCY)
-
-/* Default value in case automatic calibration fails */
+/* Used until background calibration succeeds */
 #define DEFAULT_OPTO_HYSTERESIS	(320U * USEC_TO_NANOSEC)
-/* Time to perform averaging */
-#define CALIB_TIME_MS			5000
-/* Buffer lenght for averaging period time */
-#define CALIB_BUFFER_LENGTH		((CALIB_TIME_MS / SEC_TO_MSEC) * MAX_FREQUENCY)
+/* Cached values out of these bounds are ignored */
+#define MIN_OPTO_HYSTERESIS_us	1U
+#define MAX_OPTO_HYSTERESIS_us	2000U
+/* Zero crossing callbacks, eg: triacdrv */
+#define ACLINE_MAX_CALLBACKS	4
+
+/* Zero crossing history, about 20 secs at 50Hz. Must be a power of 2 */
+#define RING_SIZE				1024U
+#define RING_MASK				(RING_SIZE - 1)
 
 
 static unsigned int irqNumber;
 
-/* AC mains time measurements struct */
+/* AC mains time measurements struct.
+ * timestamp and period_time are raw, from last two rising edges.
+ * They are only touched by IRQ handler, which publishes results
+ * on snapshot for other modules. IRQ is the only writer, so
+ * a seqcount is enough and readers never block it
+ */
 static struct acline_time {
 	ktime_t timestamp;
 	ktime_t old_timestamp;
 	ktime_t period_time;
-	spinlock_t lock;
-	unsigned long spin_flags;
+	struct acline_pll pll;
+	seqcount_t seq;
+	struct acline_snapshot snapshot;
 } acline_phase;
 
-/* Optocoupler calibration struct */
+/* Optocoupler calibration struct. high and low are optocoupler
+ * output times for current window, windows counts successful ones.
+ * cached is set if hysteresis came from module parameter
+ */
 static struct calib {
-	ktime_t period_pos[CALIB_BUFFER_LENGTH];
-	ktime_t period_neg[CALIB_BUFFER_LENGTH];
-	unsigned int samples_pos;
-	unsigned int samples_neg;
+	struct calib_stats high;
+	struct calib_stats low;
+	ktime_t falling;
+	unsigned int windows;
+	bool cached;
 	unsigned int opto_hysteresis;
 } calibration;
 
+static acline_callback_t callbacks[ACLINE_MAX_CALLBACKS];
+
+/* Batch window. hold is requested from user-mode and latched
+ * on every zero crossing, so all TRIAC channels see the same value
+ * during a whole AC cycle
+ */
+static struct acline_batch {
+	atomic_t hold;
+	atomic_t latched;
+} batch;
+
+/* Zero crossing ring buffer. IRQ handler is the only writer, and
+ * never waits for readers: every /dev/acline reader keeps its own
+ * position and detects overwritten slots from their sequence number
+ */
+struct acline_slot {
+	unsigned long seq;
+	struct acline_sample sample;
+};
+
+static struct acline_ring {
+	struct acline_slot slot[RING_SIZE];
+	/* Sequence number of next sample to be written. Native word,
+	 * so acquire/release also work on 32-bit ARM
+	 */
+	unsigned long head;
+	atomic64_t total_lost;
+	wait_queue_head_t wq;
+} ring;
+
+/* Per open file state */
+struct acline_reader {
+	struct mutex lock;
+	unsigned long pos;
+	u64 lost;
+};
+
+/* Samples copied to user-mode at once */
+#define READ_CHUNK				32
+
 static struct kobject *acline_kobject;
 
-/* Exported functions */
-ktime_t acline_get_sync_timestamp(void);
-unsigned int acline_get_period(void);
-unsigned int acline_get_optohyst(void);
-unsigned int acline_get_irq(void);
-struct kobject * acline_get_kobject(void);
+/* Exported functions are declared on acline.h */
+static void acline_publish(void);
 
 /* IRQ functions */
-static u64 int_pow(u64 base, unsigned int exp);
 static int acline_irq_start(void);
 static void acline_irq_end(void);
 static irq_handler_t acline_gpio_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
 // static irq_handler_t acline_gpio_irq_handler_thread(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static irq_handler_t acline_calibration_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static int acline_irq_calibrate(void);
+
+/* Calibration functions, timing math is on timing.h */
+static void acline_calib_window(void);
+
+/* Ring buffer functions */
+static void acline_ring_push(ktime_t timestamp, ktime_t period);
+static bool acline_ring_get(struct acline_reader *reader, struct acline_sample *sample);
+static int acline_dev_open(struct inode *inode, struct file *file);
+static int acline_dev_release(struct inode *inode, struct file *file);
+static ssize_t acline_dev_read(struct file *file, char __user *buff, size_t count, loff_t *ppos);
+static __poll_t acline_dev_poll(struct file *file, poll_table *wait);
+static long acline_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int acline_dev_start(void);
+static void acline_dev_end(void);
+
+static const struct file_operations acline_fops = {
+	.owner = THIS_MODULE,
+	.open = acline_dev_open,
+	.release = acline_dev_release,
+	.read = acline_dev_read,
+	.poll = acline_dev_poll,
+	.unlocked_ioctl = acline_dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice acline_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "acline",
+	.fops = &acline_fops,
+	.mode = 0444,
+};
 
 /* GPIO functions */
 static int acline_gpio_start(void);
@@ -107,7 +199,12 @@ static void acline_gpio_end(void);
 static int acline_sysfs_start(void);
 static void acline_sysfs_end(void);
 static ssize_t acline_get_freq(struct kobject *kobj, struct kobj_attribute *attr, char *buff);
+static ssize_t acline_get_batch(struct kobject *kobj, struct kobj_attribute *attr, char *buff);
+static ssize_t acline_set_batch(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count);
+static ssize_t acline_get_optohyst_sysfs(struct kobject *kobj, struct kobj_attribute *attr, char *buff);
 static struct kobj_attribute sysfs = __ATTR(SYSFS_OBJECT, 0444, acline_get_freq, NULL);
+static struct kobj_attribute sysfs_batch = __ATTR(SYSFS_BATCH_OBJECT, 0664, acline_get_batch, acline_set_batch);
+static struct kobj_attribute sysfs_optohyst = __ATTR(SYSFS_OPTOHYST_OBJECT, 0444, acline_get_optohyst_sysfs, NULL);
 
 
 static int __init acline_init(void);
@@ -0,0 +1,42 @@
+#ifndef ACLINEDRV_IOCTL_H
+#define ACLINEDRV_IOCTL_H
+
+/* Binary interface to aclinedrv.ko zero-crossing stream, shared by
+ * Kernel module and user-mode tools
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Character device node. read() returns struct acline_sample records,
+ * oldest first, starting from oldest one still on ring buffer
+ */
+#define ACLINE_DEVICE			"/dev/acline"
+
+/* One zero crossing */
+struct acline_sample {
+	/* CLOCK_MONOTONIC time of optocoupler edge, ns */
+	__u64 timestamp_ns;
+	/* Time since previous zero crossing, ns */
+	__u32 period_ns;
+	/* Samples this reader lost right before this one, because
+	 * ring buffer was overwritten before they were read
+	 */
+	__u32 lost;
+};
+
+struct acline_stats {
+	/* Zero crossings recorded since module load. Kernel counts them
+	 * on a native word, so it wraps at 2^32 on 32-bit machines
+	 */
+	__u64 samples;
+	/* Samples lost by this reader */
+	__u64 lost;
+	/* Samples lost by every reader since module load */
+	__u64 total_lost;
+};
+
+#define ACLINE_IOC_MAGIC		'A'
+#define ACLINE_IOC_STATS		_IOR(ACLINE_IOC_MAGIC, 0, struct acline_stats)
+
+#endif // ACLINEDRV_IOCTL_H
@@ -0,0 +1,322 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+/* AC line and TRIAC trigger timing math, shared by aclinedrv.ko,
+ * triacdrv.ko and triacsim user-mode simulator. Everything here is
+ * static inline, works on nanoseconds and never sleeps nor locks,
+ * so it can be called from IRQ context
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Just enough Kernel types and helpers to build in user-mode */
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef s64 ktime_t;
+
+#define ktime_to_ns(kt)			(kt)
+#define ktime_add_ns(kt, nsval)	((kt) + (nsval))
+#define ktime_sub(lhs, rhs)		((lhs) - (rhs))
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div64_s64(s64 dividend, s64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+#endif
+
+
+/* Time conversion constants */
+#define SEC_TO_MSEC				1000U
+#define USEC_TO_NANOSEC			1000U
+#define MSEC_TO_NANOSEC			(1000U * USEC_TO_NANOSEC)
+#define SEC_TO_NANOSEC			(1000U * MSEC_TO_NANOSEC)
+
+/* Minimum accepted frequency */
+#define MIN_FREQUENCY			40U //Hz
+/* Maximum accepted frequency */
+#define MAX_FREQUENCY			70U //Hz
+/* Minimum accepted period */
+#define MIN_PERIOD_ns			(SEC_TO_NANOSEC / MAX_FREQUENCY)
+/* Maximum accepted period */
+#define MAX_PERIOD_ns			(SEC_TO_NANOSEC / MIN_FREQUENCY)
+
+/* Time to perform averaging */
+#define CALIB_TIME_MS			5000
+/* Samples per calibration window, about CALIB_TIME_MS at 50Hz */
+#define CALIB_WINDOW			((CALIB_TIME_MS / SEC_TO_MSEC) * 50U)
+/* Both half cycles must stay under 50us standard deviation */
+#define CALIB_MAX_VARIANCE		((u64)(50U * USEC_TO_NANOSEC) * (50U * USEC_TO_NANOSEC))
+
+/* Period tracking filter. Both gains are divisors of phase error:
+ * crossing time is corrected by error / PLL_ALPHA and period by
+ * error / PLL_BETA, close to critical damping
+ */
+#define PLL_ALPHA				4
+#define PLL_BETA				32
+/* Fractional bits kept on filtered period */
+#define PLL_FRAC_SHIFT			8
+/* Edges this far from predicted crossing are rejected as noise */
+#define PLL_OUTLIER_ns			(1000U * USEC_TO_NANOSEC)
+/* Rejected edges before filter drops lock and restarts from raw
+ * period, eg: after a generator frequency step. Every accepted edge
+ * takes one off, so a false lock on a wrong period (eg: a glitch on
+ * first cycle), where most edges are rejected, is dropped too
+ */
+#define PLL_MAX_REJECTS			8
+
+/* TRIAC pulse definitions */
+#define MIN_PULSE_US			5U
+#define MAX_PULSE_US			2000U
+/* Gate is always released this long before next zero crossing,
+ * so a wide pulse cannot re-trigger TRIAC on the following cycle
+ */
+#define PULSE_GUARD				(50U * USEC_TO_NANOSEC)
+/* Phase guard degrees
+ * eg: how many degrees close to edge
+ * values will be ignored
+ */
+#define PHASE_GUARD				7
+
+/* Period tracking filter. sync is filtered time of last accepted
+ * rising edge, and next is predicted time of following one
+ */
+struct acline_pll {
+	bool locked;
+	unsigned int rejects;
+	/* Fixed point, PLL_FRAC_SHIFT fractional bits */
+	s64 period;
+	ktime_t sync;
+	ktime_t next;
+};
+
+/* Running mean and sum of squared deviations, in ns */
+struct calib_stats {
+	unsigned int count;
+	s64 mean;
+	u64 m2;
+};
+
+/* Channel drive for a pair of conduction angles */
+enum timing_drive {
+	TIMING_OFF,
+	TIMING_ON,
+	TIMING_PHASE,
+};
+
+
+/* Period tracking filter section. A second order loop runs on
+ * rising edges: phase error against predicted crossing corrects both
+ * crossing time and period estimate, so a single noisy edge only moves
+ * them a fraction of its error. Edges too far from prediction are
+ * dropped, and whole cycles are skipped if edges went missing.
+ */
+static inline void timing_pll_reset(struct acline_pll *pll)
+{
+	pll->locked = false;
+	pll->rejects = 0;
+
+	return;
+}
+
+/* Returns false if edge was rejected. period is raw time from previous
+ * rising edge, cached_period (if not zero) allows locking on very
+ * first edge
+ */
+static inline bool timing_pll_update(struct acline_pll *pll, ktime_t timestamp, ktime_t period, unsigned int cached_period)
+{
+	s64 period_ns, error, cycles;
+
+	/* Start tracking from raw period, as soon as it looks sane */
+	if (!pll->locked) {
+		period_ns = ktime_to_ns(period);
+		if (period_ns <= MIN_PERIOD_ns || period_ns >= MAX_PERIOD_ns)
+			period_ns = cached_period;
+		if (period_ns <= MIN_PERIOD_ns || period_ns >= MAX_PERIOD_ns)
+			return true;
+
+		pll->period = period_ns << PLL_FRAC_SHIFT;
+		pll->sync = timestamp;
+		pll->next = ktime_add_ns(timestamp, period_ns);
+		pll->rejects = 0;
+		pll->locked = true;
+		return true;
+	}
+
+	period_ns = pll->period >> PLL_FRAC_SHIFT;
+	error = ktime_to_ns(ktime_sub(timestamp, pll->next));
+
+	/* Edges went missing, eg: masked by noise */
+	if (error > period_ns / 2) {
+		cycles = div64_s64(error + period_ns / 2, period_ns);
+		pll->next = ktime_add_ns(pll->next, cycles * period_ns);
+		error -= cycles * period_ns;
+	}
+
+	if (error > PLL_OUTLIER_ns || error < -(s64)PLL_OUTLIER_ns) {
+		if (++pll->rejects > PLL_MAX_REJECTS)
+			timing_pll_reset(pll);
+		return false;
+	}
+
+	if (pll->rejects)
+		pll->rejects--;
+	pll->sync = ktime_add_ns(pll->next, div_s64(error, PLL_ALPHA));
+	pll->period += div_s64(error * (1 << PLL_FRAC_SHIFT), PLL_BETA);
+
+	/* Followed mains out of bounds */
+	period_ns = pll->period >> PLL_FRAC_SHIFT;
+	if (period_ns <= MIN_PERIOD_ns || period_ns >= MAX_PERIOD_ns) {
+		timing_pll_reset(pll);
+		return true;
+	}
+
+	pll->next = ktime_add_ns(pll->sync, period_ns);
+
+	return true;
+}
+
+/* Mains period for triggering: filtered while locked, raw otherwise.
+ * 0 if out of normal mains Hz boundary
+ */
+static inline unsigned int timing_period(const struct acline_pll *pll, ktime_t raw_period)
+{
+	s64 period_ns;
+
+	if (pll->locked)
+		period_ns = pll->period >> PLL_FRAC_SHIFT;
+	else
+		period_ns = ktime_to_ns(raw_period);
+
+	return (period_ns > MIN_PERIOD_ns && period_ns < MAX_PERIOD_ns) ? period_ns : 0;
+}
+
+
+/* Optocoupler calibration section. Welford running mean and variance
+ * of optocoupler high and low times
+ */
+static inline void timing_calib_add(struct calib_stats *stats, ktime_t duration)
+{
+	s64 x = ktime_to_ns(duration);
+	s64 delta;
+
+	/* Missing edges, not a half cycle */
+	if (x <= 0 || x >= MAX_PERIOD_ns)
+		return;
+
+	stats->count++;
+	delta = x - stats->mean;
+	stats->mean += div_s64(delta, stats->count);
+	stats->m2 += delta * (x - stats->mean);
+
+	return;
+}
+
+/* Closes a calibration window once both half cycles have CALIB_WINDOW
+ * samples. Returns true if they were stable enough, and hysteresis
+ * was updated
+ */
+static inline bool timing_calib_window(struct calib_stats *high, struct calib_stats *low, unsigned int *hysteresis)
+{
+	bool stable;
+
+	if (high->count < CALIB_WINDOW || low->count < CALIB_WINDOW)
+		return false;
+
+	stable = div64_u64(high->m2, high->count) < CALIB_MAX_VARIANCE &&
+			 div64_u64(low->m2, low->count) < CALIB_MAX_VARIANCE &&
+			 high->mean > low->mean;
+	if (stable)
+		*hysteresis = (high->mean - low->mean) / 4;
+
+	high->count = 0;
+	high->mean = 0;
+	high->m2 = 0;
+	low->count = 0;
+	low->mean = 0;
+	low->m2 = 0;
+
+	return stable;
+}
+
+
+/* Trigger section */
+
+/* Will convert angle to nanoseconds
+ * In case phase is zero, will return zero and not period_ns / 2
+ * as expected.
+ * This allows pulse skipping
+ * Product goes over 32 bits (180 * 25ms is 4.5e9ns), so it is done on u64
+ */
+static inline unsigned int timing_phase_to_ns(unsigned int phase, unsigned int period_ns)
+{
+	return (phase ? div_u64((u64)(180 - phase) * period_ns, 360) : 0);
+}
+
+/* Trigger pulse width. Configured width is cut short when trigger
+ * is close to the end of the half cycle, so gate is released
+ * PULSE_GUARD before next zero crossing
+ */
+static inline unsigned int timing_pulse_ns(unsigned int pulse_ns, unsigned int phase_ns, unsigned int period_ns)
+{
+	unsigned int left_ns = period_ns / 2 - phase_ns;
+
+	if (pulse_ns + PULSE_GUARD > left_ns) {
+		if (left_ns > PULSE_GUARD + MIN_PULSE_US * USEC_TO_NANOSEC)
+			pulse_ns = left_ns - PULSE_GUARD;
+		else
+			pulse_ns = MIN_PULSE_US * USEC_TO_NANOSEC;
+	}
+
+	return pulse_ns;
+}
+
+/* Angles close to both ends drive channel steady. Otherwise they are
+ * bound, to avoid triggering near zero-crossings
+ */
+static inline enum timing_drive timing_bound_phases(unsigned int *pos_phase, unsigned int *neg_phase)
+{
+	/* If both phases are near zero, turn off triac */
+	if (*pos_phase < (0 + PHASE_GUARD) && *neg_phase < (0 + PHASE_GUARD))
+		return TIMING_OFF;
+
+	/* If both phases are near 180, fully turn on triac */
+	if (*pos_phase > (180 - PHASE_GUARD) && *neg_phase > (180 - PHASE_GUARD))
+		return TIMING_ON;
+
+	if (*pos_phase > (180 - PHASE_GUARD))
+		*pos_phase = (180 - PHASE_GUARD);
+	else if (*pos_phase < (0 + PHASE_GUARD))
+		*pos_phase = 0;
+
+	if (*neg_phase > (180 - PHASE_GUARD))
+		*neg_phase = (180 - PHASE_GUARD);
+	else if (*neg_phase < (0 + PHASE_GUARD))
+		*neg_phase = 0;
+
+	return TIMING_PHASE;
+}
+
+#endif // TIMING_H
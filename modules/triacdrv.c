@@ -1,23 +1,38 @@
 /*
- * triacdrv.c - triggers a single TRIAC according to requested conduction
- * angle.
+ * triacdrv.c - triggers TRIACs according to requested conduction
+ * angles.
  * 
  * 
- * This module will trigger a single TRIAC on its configured GPIO pin.
- * It will make calculations to convert requested phase conduction angle
- * to a nanosecond-precision timestamp for doing the trigger.
+ * This module will trigger every TRIAC channel on its configured GPIO pin.
+ * A single IRQ handler serves all channels: on each zero crossing it
+ * converts requested phase conduction angles to nanosecond-precision
+ * timestamps, sorts them and arms one hrtimer chain. Timer callbacks
+ * raise and lower the GPIOs, so no thread sleeps for a whole AC cycle.
+ * If a zero crossing is rejected as noise or goes missing, the cycle is
+ * planned from aclinedrv predicted crossing instead (flywheel).
  * 
  * Module continuously request period measurements to adjust for small
  * deviations in AC mains signal. It also compensates for optocoupler
  * hysteresis time.
- * It adjusts trigger pulse width for high or low conduction angles to
- * prevent TRIAC misfire.
+ * Trigger pulse width is configurable per channel at runtime. Pulse end is
+ * its own timer event, and it is cut short so gate is always released
+ * before next zero crossing, preventing TRIAC misfire.
  * 
  * Phase control is asymmetrical, so a non-zero mean-value signal can be
  * generated. Useful for obtaining a positive or negative DC value
  * for motor control or Peltier cells.
  * 
  * It also provides a sysfs interface for runtime changing phase angles
+ * and trigger pulse widths, and a /dev/triacd character device taking
+ * binary setpoints for any number of channels in a single call.
+ * /dev/triacd can also be mmap()ed: setpoints written on that page are
+ * picked up on next zero crossing without any syscall, and triacdrv
+ * publishes its timing status there.
+ * Fades can run inside the module too: conduction angles are ramped
+ * one step on every AC half cycle, synchronised to mains, and user-mode
+ * is notified thru poll() when they end.
+ * Delay of every trigger against its scheduled time is kept on
+ * per-channel histograms, on debugfs triacdrv/jitter.
  *
  * Copyright (C) 2019 Victor Preatoni
  */
@@ -26,32 +41,58 @@
 
 
 /* SYSFS section to allow reading and writing phase
- * conduction angles from user-mode
+ * conduction angles from user-mode. One node per channel
  */
 static int triacdrv_sysfs_start(void)
 {
+	unsigned int i;
+	
 	/* Module requires aclinedrv.ko to be running */
 	triacdrv_kobject = acline_get_kobject();
+	if (!triacdrv_kobject)
+		return -EIO;
 	
-	sysfs.attr.name = name;
-
-	if (triacdrv_kobject) {
-		if (sysfs_create_file(triacdrv_kobject, &sysfs.attr)) {
-			printk(KERN_ERR "%s: failed to create sysfs\n", name);
+	for (i = 0; i < channel_count; i++) {
+		sysfs_attr_init(&channels[i].sysfs.attr);
+		channels[i].sysfs.attr.name = channels[i].name;
+		channels[i].sysfs.attr.mode = 0664;
+		channels[i].sysfs.show = triacdrv_get;
+		channels[i].sysfs.store = triacdrv_set;
+		
+		snprintf(channels[i].pulse_name, sizeof(channels[i].pulse_name), "%s%s", channels[i].name, TRIAC_PULSE_SUFFIX);
+		sysfs_attr_init(&channels[i].sysfs_pulse.attr);
+		channels[i].sysfs_pulse.attr.name = channels[i].pulse_name;
+		channels[i].sysfs_pulse.attr.mode = 0664;
+		channels[i].sysfs_pulse.show = triacdrv_get_pulse;
+		channels[i].sysfs_pulse.store = triacdrv_set_pulse;
+		
+		if (sysfs_create_file(triacdrv_kobject, &channels[i].sysfs.attr)) {
+			printk(KERN_ERR "%s: failed to create sysfs\n", channels[i].name);
+			triacdrv_sysfs_end(i);
 			return -EIO;
 		}
-		else {
-			printk(KERN_INFO "%s: GPIO %02u\n", name, gpio);
-			return 0;
+		
+		if (sysfs_create_file(triacdrv_kobject, &channels[i].sysfs_pulse.attr)) {
+			printk(KERN_ERR "%s: failed to create sysfs\n", channels[i].name);
+			sysfs_remove_file(triacdrv_kobject, &channels[i].sysfs.attr);
+			triacdrv_sysfs_end(i);
+			return -EIO;
 		}
+		printk(KERN_INFO "%s: GPIO %02u\n", channels[i].name, channels[i].gpio);
 	}
-	else
-		return -EIO;
+	
+	return 0;
 }
 
-static void triacdrv_sysfs_end(void)
+static void triacdrv_sysfs_end(unsigned int count)
 {
-	sysfs_remove_file(triacdrv_kobject, &sysfs.attr);
+	unsigned int i;
+	
+	for (i = 0; i < count; i++) {
+		sysfs_remove_file(triacdrv_kobject, &channels[i].sysfs_pulse.attr);
+		sysfs_remove_file(triacdrv_kobject, &channels[i].sysfs.attr);
+	}
+	
 	return;
 }
 
@@ -60,82 +101,651 @@ static void triacdrv_sysfs_end(void)
  */
 static ssize_t triacdrv_set(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
 {
-	unsigned int pos_phase;
-	unsigned int neg_phase;
+	struct triac_channel *ch = container_of(attr, struct triac_channel, sysfs);
+	struct triacd_setpoint sp;
 	unsigned int phase_vars;
 	
-	phase_vars = sscanf(buff, "%u %u", &pos_phase, &neg_phase);
+	sp.channel = ch - channels;
+	phase_vars = sscanf(buff, "%u %u", &sp.pos, &sp.neg);
 	switch (phase_vars) {
 	case 2:
-		if (pos_phase > 180 || neg_phase > 180)
-			printk(KERN_ERR "%s: phase limit is 0-180 degrees\n", name);
-		else {
-			atomic_set(&phase.pos, pos_phase);
-			atomic_set(&phase.neg, neg_phase);
+		if (sp.pos > 180 || sp.neg > 180) {
+			printk(KERN_ERR "%s: phase limit is 0-180 degrees\n", ch->name);
+			return -ERANGE;
 		}
 		break;
 		
 	case 1:
-		if (pos_phase > 180)
-			printk(KERN_ERR "%s: phase limit is 0-180 degrees\n", name);
-		else {
-			atomic_set(&phase.pos, pos_phase);
-			atomic_set(&phase.neg, pos_phase);
+		if (sp.pos > 180) {
+			printk(KERN_ERR "%s: phase limit is 0-180 degrees\n", ch->name);
+			return -ERANGE;
 		}
+		sp.neg = sp.pos;
 		break;
 		
 	default:
-		printk(KERN_ERR "%s: wrong parameter\n", name);
+		printk(KERN_ERR "%s: wrong parameter\n", ch->name);
+		return -EINVAL;
 	}
 	
+	/* Same path as /dev/triacd, so a running fade is stopped */
+	triacdrv_apply_setpoints(&sp, 1);
+	
 	return count;
 }
 
 /* Returns current phase for positive and negative conduction angles */
 static ssize_t triacdrv_get(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
 {
+	struct triac_channel *ch = container_of(attr, struct triac_channel, sysfs);
 	unsigned int pos_phase;
 	unsigned int neg_phase;
 	int count;
 	
-	pos_phase = atomic_read(&phase.pos);
-	neg_phase = atomic_read(&phase.neg);
+	pos_phase = atomic_read(&ch->staged.pos);
+	neg_phase = atomic_read(&ch->staged.neg);
 
 	count = scnprintf(buff, PAGE_SIZE, "%u %u\n", pos_phase, neg_phase);
 
 	return count;
 }
 
-/* Will convert angle to nanoseconds
- * In case phase is zero, will return zero and not period_ns / 2
- * as expected.
- * This allows pulse skipping
+/* Character device section. Binary setpoints can be sent with
+ * write() (an array of struct triacd_setpoint) or TRIACD_IOC_SET.
+ * read() returns current setpoints of every channel, and poll()
+ * reports when a new setpoint took effect
+ */
+static int triacdrv_check_setpoints(const struct triacd_setpoint *sp, unsigned int count)
+{
+	unsigned int i;
+	
+	if (!count || count > TRIACD_MAX_SETPOINTS)
+		return -EINVAL;
+	
+	for (i = 0; i < count; i++) {
+		if (sp[i].channel >= channel_count)
+			return -ENODEV;
+		if (sp[i].pos > 180 || sp[i].neg > 180)
+			return -ERANGE;
+	}
+	
+	return 0;
+}
+
+/* All channels are staged under trigger chain lock, so zero crossing
+ * IRQ takes either all of them or none. A new setpoint stops any fade
+ * running on its channel
+ */
+static void triacdrv_apply_setpoints(const struct triacd_setpoint *sp, unsigned int count)
+{
+	unsigned int i;
+	unsigned long flags;
+	struct triac_channel *ch;
+	
+	raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+	for (i = 0; i < count; i++) {
+		ch = &channels[sp[i].channel];
+		ch->fade.active = false;
+		atomic_set(&ch->staged.pos, sp[i].pos);
+		atomic_set(&ch->staged.neg, sp[i].neg);
+	}
+	raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+	
+	return;
+}
+
+static unsigned int triacdrv_read_setpoints(struct triacd_setpoint *sp, unsigned int count)
+{
+	unsigned int i;
+	
+	count = min(count, channel_count);
+	for (i = 0; i < count; i++) {
+		sp[i].channel = i;
+		sp[i].pos = atomic_read(&channels[i].staged.pos);
+		sp[i].neg = atomic_read(&channels[i].staged.neg);
+	}
+	
+	return count;
+}
+
+static int triacdrv_check_fades(const struct triacd_fade *fade, unsigned int count)
+{
+	unsigned int i;
+	
+	if (!count || count > TRIACD_MAX_SETPOINTS)
+		return -EINVAL;
+	
+	for (i = 0; i < count; i++) {
+		if (fade[i].channel >= channel_count)
+			return -ENODEV;
+		if (fade[i].pos > 180 || fade[i].neg > 180 || fade[i].time_ms > MAX_FADE_MS)
+			return -ERANGE;
+	}
+	
+	return 0;
+}
+
+/* Starts fades from latest staged angles. Step count is fixed here from
+ * current AC period, two steps per cycle, and last step always lands
+ * exactly on target. All fades start on the same zero crossing
+ */
+static void triacdrv_start_fades(const struct triacd_fade *fade, unsigned int count)
+{
+	unsigned int i;
+	unsigned int steps;
+	unsigned int period_ns;
+	int pos_phase, neg_phase;
+	unsigned long flags;
+	struct triac_channel *ch;
+	
+	period_ns = acline_get_period();
+	if (!period_ns)
+		period_ns = DEFAULT_PERIOD_NS;
+	
+	raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+	
+	/* Setpoints user-mode wrote on shared page before this call
+	 * must not stop fades started now
+	 */
+	if (!acline_get_batch_hold())
+		triacdrv_shm_take();
+	
+	for (i = 0; i < count; i++) {
+		ch = &channels[fade[i].channel];
+		
+		if (!fade[i].time_ms) {
+			ch->fade.active = false;
+			continue;
+		}
+		
+		steps = div_u64((u64)fade[i].time_ms * MSEC_TO_NANOSEC * 2, period_ns);
+		if (!steps) {
+			ch->fade.active = false;
+			atomic_set(&ch->staged.pos, fade[i].pos);
+			atomic_set(&ch->staged.neg, fade[i].neg);
+			continue;
+		}
+		
+		pos_phase = atomic_read(&ch->staged.pos);
+		neg_phase = atomic_read(&ch->staged.neg);
+		
+		ch->fade.steps = steps;
+		ch->fade.pos = pos_phase << FADE_SHIFT;
+		ch->fade.neg = neg_phase << FADE_SHIFT;
+		ch->fade.pos_step = div_s64((s64)((int)fade[i].pos - pos_phase) * (1 << FADE_SHIFT), steps);
+		ch->fade.neg_step = div_s64((s64)((int)fade[i].neg - neg_phase) * (1 << FADE_SHIFT), steps);
+		ch->fade.pos_target = fade[i].pos;
+		ch->fade.neg_target = fade[i].neg;
+		ch->fade.active = true;
+	}
+	
+	raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+	
+	return;
+}
+
+/* Bitmask of channels with a fade in progress */
+static u32 triacdrv_fading(void)
+{
+	unsigned int i;
+	u32 mask = 0;
+	
+	for (i = 0; i < channel_count && i < 32; i++)
+		if (READ_ONCE(channels[i].fade.active))
+			mask |= BIT(i);
+	
+	return mask;
+}
+
+/* Tells /dev/triacd pollers something changed. Must be called
+ * outside trigger chain lock
+ */
+static void triacdrv_notify(void)
+{
+	atomic_inc(&generation);
+	wake_up_interruptible(&generation_wq);
+	
+	return;
+}
+
+/* Every open file keeps last generation it has seen */
+static int triacdrv_dev_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)atomic_read(&generation);
+	/* Setpoints are read whole every time, there is nothing to seek */
+	return stream_open(inode, file);
+}
+
+static ssize_t triacdrv_dev_read(struct file *file, char __user *buff, size_t count, loff_t *ppos)
+{
+	struct triacd_setpoint sp[TRIACD_MAX_SETPOINTS];
+	unsigned int n;
+	
+	n = count / sizeof(struct triacd_setpoint);
+	if (!n)
+		return -EINVAL;
+	
+	file->private_data = (void *)(unsigned long)atomic_read(&generation);
+	n = triacdrv_read_setpoints(sp, min_t(unsigned int, n, TRIACD_MAX_SETPOINTS));
+	if (copy_to_user(buff, sp, n * sizeof(struct triacd_setpoint)))
+		return -EFAULT;
+	
+	return n * sizeof(struct triacd_setpoint);
+}
+
+static ssize_t triacdrv_dev_write(struct file *file, const char __user *buff, size_t count, loff_t *ppos)
+{
+	struct triacd_setpoint sp[TRIACD_MAX_SETPOINTS];
+	unsigned int n;
+	int err;
+	
+	if (count % sizeof(struct triacd_setpoint) || count > sizeof(sp))
+		return -EINVAL;
+	
+	n = count / sizeof(struct triacd_setpoint);
+	if (copy_from_user(sp, buff, count))
+		return -EFAULT;
+	
+	err = triacdrv_check_setpoints(sp, n);
+	if (err)
+		return err;
+	
+	triacdrv_apply_setpoints(sp, n);
+	
+	return count;
+}
+
+static __poll_t triacdrv_dev_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &generation_wq, wait);
+	
+	if ((unsigned long)file->private_data != (unsigned long)atomic_read(&generation))
+		return EPOLLIN | EPOLLRDNORM;
+	
+	return 0;
+}
+
+static long triacdrv_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct triacd_setpoints sps;
+	struct triacd_fades fades;
+	struct triacd_info info;
+	void __user *argp = (void __user *)arg;
+	int err;
+	
+	switch (cmd) {
+	case TRIACD_IOC_INFO:
+		info.channels = channel_count;
+		info.generation = atomic_read(&generation);
+		info.fading = triacdrv_fading();
+		file->private_data = (void *)(unsigned long)info.generation;
+		if (copy_to_user(argp, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+		
+	case TRIACD_IOC_SET:
+		if (copy_from_user(&sps, argp, sizeof(sps)))
+			return -EFAULT;
+		err = triacdrv_check_setpoints(sps.setpoint, sps.count);
+		if (err)
+			return err;
+		triacdrv_apply_setpoints(sps.setpoint, sps.count);
+		return 0;
+		
+	case TRIACD_IOC_GET:
+		memset(&sps, 0, sizeof(sps));
+		file->private_data = (void *)(unsigned long)atomic_read(&generation);
+		sps.count = triacdrv_read_setpoints(sps.setpoint, TRIACD_MAX_SETPOINTS);
+		if (copy_to_user(argp, &sps, sizeof(sps)))
+			return -EFAULT;
+		return 0;
+		
+	case TRIACD_IOC_FADE:
+		if (copy_from_user(&fades, argp, sizeof(fades)))
+			return -EFAULT;
+		err = triacdrv_check_fades(fades.fade, fades.count);
+		if (err)
+			return err;
+		triacdrv_start_fades(fades.fade, fades.count);
+		/* Stopped fades are reported right away */
+		triacdrv_notify();
+		return 0;
+		
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Maps shared page. Mapping keeps a reference on the file, so
+ * page cannot go away while user-mode uses it
+ */
+static int triacdrv_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(shm) >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+}
+
+static int triacdrv_dev_start(void)
+{
+	unsigned int i;
+	
+	shm = (struct triacd_shm *)get_zeroed_page(GFP_KERNEL);
+	if (!shm)
+		return -ENOMEM;
+	
+	shm->channels = channel_count;
+	for (i = 0; i < channel_count && i < TRIACD_SHM_CHANNELS; i++) {
+		channels[i].shm = &shm->channel[i];
+		channels[i].shm->pos = atomic_read(&channels[i].staged.pos);
+		channels[i].shm->neg = atomic_read(&channels[i].staged.neg);
+		channels[i].shm_serial = 0;
+	}
+	
+	if (misc_register(&triacdrv_dev)) {
+		printk(KERN_ERR "triacdrv: cannot register %s\n", TRIACD_DEVICE);
+		free_page((unsigned long)shm);
+		return -EIO;
+	}
+	
+	return 0;
+}
+
+static void triacdrv_dev_end(void)
+{
+	misc_deregister(&triacdrv_dev);
+	free_page((unsigned long)shm);
+	return;
+}
+
+/* Takes setpoints from shared page, if user-mode finished a new update.
+ * Only slots whose serial changed since last update are taken, so
+ * setpoints written thru sysfs or write(), or running fades, are not
+ * overridden by stale page values.
+ * Runs under trigger chain lock, like triacdrv_apply_setpoints()
+ */
+static void triacdrv_shm_take(void)
+{
+	u32 seq;
+	unsigned int i, n;
+	unsigned int pos_phase, neg_phase;
+	
+	seq = smp_load_acquire(&shm->seq);
+	if (seq == shm_seq || (seq & 1))
+		return;
+	
+	/* Serial is stored last by user-mode, so pos/neg read after it
+	 * are at least as new
+	 */
+	for (n = 0; n < channel_count && channels[n].shm; n++) {
+		shm_snapshot[n].serial = smp_load_acquire(&channels[n].shm->serial);
+		shm_snapshot[n].pos = READ_ONCE(channels[n].shm->pos);
+		shm_snapshot[n].neg = READ_ONCE(channels[n].shm->neg);
+	}
+	
+	smp_rmb();
+	/* User-mode started another update meanwhile, take it next time */
+	if (READ_ONCE(shm->seq) != seq)
+		return;
+	
+	for (i = 0; i < n; i++) {
+		if (shm_snapshot[i].serial == channels[i].shm_serial)
+			continue;
+		channels[i].shm_serial = shm_snapshot[i].serial;
+		pos_phase = shm_snapshot[i].pos;
+		neg_phase = shm_snapshot[i].neg;
+		/* Out of range values are ignored, user-mode got them wrong */
+		if (pos_phase > 180 || neg_phase > 180)
+			continue;
+		channels[i].fade.active = false;
+		atomic_set(&channels[i].staged.pos, pos_phase);
+		atomic_set(&channels[i].staged.neg, neg_phase);
+	}
+	
+	shm_seq = seq;
+	
+	return;
+}
+
+/* Publishes timing status of current AC cycle on shared page */
+static void triacdrv_shm_publish(ktime_t sync_timestamp, unsigned int period_ns)
+{
+	unsigned int i;
+	
+	WRITE_ONCE(shm->sync_ns, ktime_to_ns(sync_timestamp));
+	WRITE_ONCE(shm->period_ns, period_ns);
+	WRITE_ONCE(shm->generation, atomic_read(&generation));
+	
+	for (i = 0; i < channel_count && channels[i].shm; i++) {
+		WRITE_ONCE(channels[i].shm->active_pos, atomic_read(&channels[i].phase.pos));
+		WRITE_ONCE(channels[i].shm->active_neg, atomic_read(&channels[i].phase.neg));
+		WRITE_ONCE(channels[i].shm->fading, READ_ONCE(channels[i].fade.active));
+	}
+	
+	return;
+}
+
+/* Writer function for trigger pulse width, in microseconds */
+static ssize_t triacdrv_set_pulse(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count)
+{
+	struct triac_channel *ch = container_of(attr, struct triac_channel, sysfs_pulse);
+	unsigned int pulse_us;
+	
+	if (kstrtouint(buff, 10, &pulse_us) || pulse_us < MIN_PULSE_US || pulse_us > MAX_PULSE_US) {
+		printk(KERN_ERR "%s: pulse limit is %u-%u us\n", ch->name, MIN_PULSE_US, MAX_PULSE_US);
+		return -EINVAL;
+	}
+	
+	atomic_set(&ch->pulse_ns, pulse_us * USEC_TO_NANOSEC);
+	
+	return count;
+}
+
+/* Returns trigger pulse width, in microseconds */
+static ssize_t triacdrv_get_pulse(struct kobject *kobj, struct kobj_attribute *attr, char *buff)
+{
+	struct triac_channel *ch = container_of(attr, struct triac_channel, sysfs_pulse);
+	
+	return scnprintf(buff, PAGE_SIZE, "%u\n", atomic_read(&ch->pulse_ns) / USEC_TO_NANOSEC);
+}
+
+/* Channel trigger pulse width, cut short near the end of
+ * the half cycle (see timing.h)
  */
-static unsigned int triacdrv_phase_to_ns(unsigned int phase, unsigned int period_ns)
+static unsigned int triacdrv_pulse_ns(struct triac_channel *ch, unsigned int phase_ns, unsigned int period_ns)
+{
+	return timing_pulse_ns(atomic_read(&ch->pulse_ns), phase_ns, period_ns);
+}
+
+/* Trigger chain is sorted by timestamp */
+static int triacdrv_event_cmp(const void *a, const void *b)
+{
+	const struct triac_event *ev_a = a;
+	const struct triac_event *ev_b = b;
+	
+	return ktime_compare(ev_a->timestamp, ev_b->timestamp);
+}
+
+/* Advances a fade by one half cycle */
+static void triacdrv_fade_step(struct triac_fade *fade)
 {
-	return (phase ? ((180 - phase) * period_ns / 360) : 0);
+	if (--fade->steps) {
+		fade->pos += fade->pos_step;
+		fade->neg += fade->neg_step;
+	}
+	else {
+		fade->pos = fade->pos_target << FADE_SHIFT;
+		fade->neg = fade->neg_target << FADE_SHIFT;
+		fade->active = false;
+	}
+	
+	return;
+}
+
+/* Computes channel trigger times for current AC cycle.
+ * Fully on or off channels are driven right away
+ * Returns true if new setpoint took effect or a fade ended
+ */
+static bool triacdrv_plan_channel(struct triac_channel *ch, unsigned int period_ns, bool hold)
+{
+	unsigned int pos_phase;
+	unsigned int neg_phase;
+	bool changed = false;
+	
+	/* Fade steps once for negative half cycle, which comes first,
+	 * and once again for positive one. Staged follows it, so
+	 * sysfs and user-mode see the ramp
+	 */
+	if (ch->fade.active) {
+		triacdrv_fade_step(&ch->fade);
+		neg_phase = FADE_ROUND(ch->fade.neg);
+		if (ch->fade.active)
+			triacdrv_fade_step(&ch->fade);
+		pos_phase = FADE_ROUND(ch->fade.pos);
+		
+		atomic_set(&ch->staged.pos, pos_phase);
+		atomic_set(&ch->staged.neg, neg_phase);
+		atomic_set(&ch->phase.pos, pos_phase);
+		atomic_set(&ch->phase.neg, neg_phase);
+		changed = !ch->fade.active;
+	}
+	/* Batch window closed: take new angles on this zero crossing */
+	else if (!hold) {
+		pos_phase = atomic_read(&ch->staged.pos);
+		neg_phase = atomic_read(&ch->staged.neg);
+		if (pos_phase != atomic_read(&ch->phase.pos) || neg_phase != atomic_read(&ch->phase.neg)) {
+			atomic_set(&ch->phase.pos, pos_phase);
+			atomic_set(&ch->phase.neg, neg_phase);
+			changed = true;
+		}
+	}
+	
+	pos_phase = atomic_read(&ch->phase.pos);
+	neg_phase = atomic_read(&ch->phase.neg);
+	
+	ch->pos_phase_ns = 0;
+	ch->neg_phase_ns = 0;
+	ch->steady = true;
+	
+	switch (timing_bound_phases(&pos_phase, &neg_phase)) {
+		case TIMING_OFF:
+			gpio_set_value(ch->gpio, 0);
+			return changed;
+		case TIMING_ON:
+			gpio_set_value(ch->gpio, 1);
+			return changed;
+		default:
+			break;
+	}
+	
+	ch->steady = false;
+	ch->pos_phase_ns = timing_phase_to_ns(pos_phase, period_ns);
+	ch->neg_phase_ns = timing_phase_to_ns(neg_phase, period_ns);
+	
+	return changed;
 }
 
-/* Properly triggers a single TRIAC */
-static void triacdrv_trigger_pulse(unsigned int phase_ns)
+/* Appends rising and falling edges of a trigger pulse to chain */
+static void triacdrv_add_trigger(ktime_t timestamp, unsigned int pulse_ns, struct triac_channel *ch)
 {
-	gpio_set_value(gpio, 1);
-	if (phase_ns < HIGH_CONDUCTION_ANGLE)
-		/* When conduction angle is high, TRIAC needs longer trigger */
-		usleep_range(TRIAC_LONG_PULSE, TRIAC_LONG_PULSE * 2);
-	else
-		/* Short trigger */
-		udelay(TRIAC_TRIGGER_PULSE);
-	gpio_set_value(gpio, 0);
+	struct triac_event *ev;
+	
+	if (trigger_chain.count + 2 > trigger_chain.size)
+		return;
+	
+	ev = &trigger_chain.events[trigger_chain.count++];
+	ev->timestamp = timestamp;
+	ev->channel = ch;
+	ev->level = 1;
+	
+	ev = &trigger_chain.events[trigger_chain.count++];
+	ev->timestamp = ktime_add_ns(timestamp, pulse_ns);
+	ev->channel = ch;
+	ev->level = 0;
+	
+	return;
+}
 
+/* Accounts a trigger delay. Cheap enough for timer callback:
+ * a few adds and compares, and a find-last-set for the bucket
+ */
+static void triacdrv_jitter_record(struct triac_jitter *jitter, ktime_t scheduled, ktime_t fired)
+{
+	s64 delay = ktime_to_ns(ktime_sub(fired, scheduled));
+	u64 delay_ns = delay > 0 ? delay : 0;
+	unsigned int bucket;
+	
+	bucket = fls64(delay_ns);
+	if (bucket >= JITTER_BUCKETS)
+		bucket = JITTER_BUCKETS - 1;
+	jitter->hist[bucket]++;
+	
+	if (!jitter->count || delay_ns < jitter->min_ns)
+		jitter->min_ns = delay_ns;
+	if (delay_ns > jitter->max_ns)
+		jitter->max_ns = delay_ns;
+	if (delay_ns > JITTER_LATE_NS)
+		jitter->late++;
+	jitter->sum_ns += delay_ns;
+	jitter->count++;
+	
 	return;
 }
 
-/* IRQ section */
+/* Fires every due edge of the chain and re-arms timer for next one.
+ * Runs on hard IRQ context (HRTIMER_MODE_ABS_HARD), so GPIO edges
+ * do not depend on any thread being scheduled on time
+ */
+static enum hrtimer_restart triacdrv_timer_callback(struct hrtimer *timer)
+{
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct triac_event *ev;
+	unsigned long flags;
+	ktime_t now, fired;
+	
+	raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+	
+	now = ktime_get();
+	while (trigger_chain.head < trigger_chain.count) {
+		ev = &trigger_chain.events[trigger_chain.head];
+		if (ktime_after(ev->timestamp, now))
+			break;
+		gpio_set_value(ev->channel->gpio, ev->level);
+		if (ev->level) {
+			fired = ktime_get();
+			triacdrv_jitter_record(&ev->channel->jitter, ev->timestamp, fired);
+			if (ev->channel->shm)
+				WRITE_ONCE(ev->channel->shm->trigger_ns, ktime_to_ns(fired));
+		}
+		trigger_chain.head++;
+	}
+	
+	/* Zero crossing IRQ may have already re-armed us */
+	if (trigger_chain.head < trigger_chain.count && !hrtimer_is_queued(timer)) {
+		hrtimer_set_expires(timer, trigger_chain.events[trigger_chain.head].timestamp);
+		ret = HRTIMER_RESTART;
+	}
+	
+	raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+	
+	return ret;
+}
+
+/* IRQ section. aclinedrv owns zero crossing IRQ, on both edges for
+ * its calibration, and calls a single handler serving all channels
+ * on every accepted rising edge
+ */
 static int triacdrv_irq_start(void)
 {   
-	if (request_threaded_irq(acline_get_irq(), (irq_handler_t)triacdrv_gpio_irq_handler, (irq_handler_t)triacdrv_gpio_irq_handler_thread, IRQF_TRIGGER_RISING | IRQF_SHARED, name, (void *)(triacdrv_gpio_irq_handler))) {
-		printk(KERN_ERR "IRQ %d: could not request\n", acline_get_irq());
+	raw_spin_lock_init(&trigger_chain.lock);
+	hrtimer_init(&trigger_chain.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	trigger_chain.timer.function = triacdrv_timer_callback;
+	hrtimer_init(&flywheel.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	flywheel.timer.function = triacdrv_flywheel_callback;
+	
+	if (acline_register_callback(triacdrv_zero_crossing)) {
+		printk(KERN_ERR "IRQ %d: could not register zero crossing handler\n", acline_get_irq());
 		return -EIO;
 	}
 	else 
@@ -144,88 +754,287 @@ static int triacdrv_irq_start(void)
 	
 static void triacdrv_irq_end(void)
 {
-	free_irq(acline_get_irq(), (void *)(triacdrv_gpio_irq_handler));
+	acline_unregister_callback(triacdrv_zero_crossing);
+	/* Flywheel can arm trigger chain, so it goes first */
+	hrtimer_cancel(&flywheel.timer);
+	hrtimer_cancel(&trigger_chain.timer);
 	return;
 }
 
-/* Simple approach to threaded IRQs. Since TRIAC trigger pulse will occur a few
- * microseconds later, we cannot sleep on main IRQ.
- */
-static irq_handler_t triacdrv_gpio_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs)
-{
-	if (dev_id == (void *)(triacdrv_gpio_irq_handler))
-		return (irq_handler_t)IRQ_WAKE_THREAD;
-	else
-		return (irq_handler_t)IRQ_NONE;
-}
-
-/* It is safe now to call sleep functions (like schedule_hrtimeout()) because
- * we are running on a separate thread.
- * So, after quickly making time calculations, we set the schedule_hrtimeout()
- * to the requested one. After schedule_hrtimeout() returns, we have to
- * immediately trigger the TRIAC, as we are on the exact trigger time for the
- * requested phase conduction angle.
- * Hopefully, threaded IRQs run on a realtime priority, so no other task
- * should preempt us. If that happens, it would be catastrophical for TRIAC
- * phase control!.
+/* Plans a whole AC cycle: time calculations for every channel, merged
+ * with edges still pending from previous cycle, then chain is sorted
+ * and hrtimer armed for the first one. Nothing here sleeps.
+ * Cycles planned from prediction drop triggers already due, as they
+ * would fire late, on a wrong angle.
+ * Runs under trigger chain lock. Returns true if a new setpoint took
+ * effect or a fade ended
  */
-static irq_handler_t triacdrv_gpio_irq_handler_thread(unsigned int irq, void *dev_id, struct pt_regs *regs)
+static bool triacdrv_plan_cycle(const struct acline_snapshot *acline, bool predicted)
 {
-	ktime_t irq_timestamp;
-	ktime_t pos_trigger_timestamp;
-	ktime_t neg_trigger_timestamp;
+	ktime_t irq_timestamp, trigger, now;
 	unsigned int period_ns;
-	unsigned int pos_phase_ns;
-	unsigned int neg_phase_ns;
-	unsigned int pos_phase = atomic_read(&phase.pos);
-	unsigned int neg_phase = atomic_read(&phase.neg);
+	unsigned int i, n;
+	bool hold;
+	bool changed = false;
+	struct triac_channel *ch;
 	
-	/* If both phases are near zero, turn off triac */
-	if (pos_phase < (0 + PHASE_GUARD) && neg_phase < (0 + PHASE_GUARD)) {
-		gpio_set_value(gpio, 0);
-		return (irq_handler_t)IRQ_HANDLED;
+	period_ns = acline->period_ns;
+	irq_timestamp = ktime_add_ns(acline->sync, acline->optohyst_ns);
+	hold = acline_get_batch_hold();
+	now = ktime_get();
+	
+	if (!hold)
+		triacdrv_shm_take();
+	
+	for (i = 0; i < channel_count; i++)
+		changed |= triacdrv_plan_channel(&channels[i], period_ns, hold);
+	
+	/* Keep edges still pending from previous cycle (eg: a late positive
+	 * trigger or its falling edge), except for channels now driven steady
+	 */
+	for (i = trigger_chain.head, n = 0; i < trigger_chain.count; i++)
+		if (!trigger_chain.events[i].channel->steady)
+			trigger_chain.events[n++] = trigger_chain.events[i];
+	trigger_chain.head = 0;
+	trigger_chain.count = n;
+	
+	for (i = 0; i < channel_count; i++) {
+		ch = &channels[i];
+		
+		/* TRIAC trigger on negative cycle */
+		trigger = ktime_add_ns(irq_timestamp, ch->neg_phase_ns);
+		if (ch->neg_phase_ns && !(predicted && ktime_before(trigger, now)))
+			triacdrv_add_trigger(trigger, triacdrv_pulse_ns(ch, ch->neg_phase_ns, period_ns), ch);
+		
+		/* TRIAC trigger on positive cycle */
+		trigger = ktime_add_ns(irq_timestamp, ch->pos_phase_ns + period_ns / 2);
+		if (ch->pos_phase_ns && !(predicted && ktime_before(trigger, now)))
+			triacdrv_add_trigger(trigger, triacdrv_pulse_ns(ch, ch->pos_phase_ns, period_ns), ch);
 	}
 	
-	/* If both phases are near 180, fully turn on triac */
-	if (pos_phase > (180 - PHASE_GUARD) && neg_phase > (180 - PHASE_GUARD)) {
-		gpio_set_value(gpio, 1);
-		return (irq_handler_t)IRQ_HANDLED;
+	sort(trigger_chain.events, trigger_chain.count, sizeof(struct triac_event), triacdrv_event_cmp, NULL);
+	
+	if (trigger_chain.count)
+		hrtimer_start(&trigger_chain.timer, trigger_chain.events[0].timestamp, HRTIMER_MODE_ABS_HARD);
+	
+	flywheel.cycle = *acline;
+	flywheel.cycles = predicted ? flywheel.cycles + 1 : 0;
+	triacdrv_flywheel_arm();
+	
+	return changed;
+}
+
+/* Arms flywheel past predicted crossing of cycle following last
+ * planned one. Not armed while aclinedrv tracking filter is unlocked,
+ * nor once mains went missing for too long.
+ * Runs under trigger chain lock
+ */
+static void triacdrv_flywheel_arm(void)
+{
+	if (!flywheel.cycle.next || !flywheel.cycle.period_ns || flywheel.cycles >= FLYWHEEL_MAX_CYCLES) {
+		flywheel.deadline = 0;
+		hrtimer_try_to_cancel(&flywheel.timer);
+		return;
 	}
 	
-	/* Bound edge values to avoid triggering near zero-crossings */
-	if (pos_phase > (180 - PHASE_GUARD))
-		pos_phase = (180 - PHASE_GUARD);
-	else if (pos_phase < (0 + PHASE_GUARD))
-		pos_phase = 0;
+	flywheel.deadline = ktime_add_ns(flywheel.cycle.next, PLL_OUTLIER_ns + FLYWHEEL_SLACK_NS);
+	hrtimer_start(&flywheel.timer, flywheel.deadline, HRTIMER_MODE_ABS_HARD);
 	
-	if (neg_phase > (180 - PHASE_GUARD))
-		neg_phase = (180 - PHASE_GUARD);
-	else if (neg_phase < (0 + PHASE_GUARD))
-		neg_phase = 0;
+	return;
+}
+
+/* No zero crossing came in time: plan cycle from prediction, and
+ * predict following one a period later
+ */
+static enum hrtimer_restart triacdrv_flywheel_callback(struct hrtimer *timer)
+{
+	struct acline_snapshot predicted;
+	unsigned long flags;
+	bool changed = false;
+	ktime_t irq_timestamp = 0;
 	
-	period_ns = acline_get_period();
-	pos_phase_ns = triacdrv_phase_to_ns(pos_phase, period_ns);
-	neg_phase_ns = triacdrv_phase_to_ns(neg_phase, period_ns);
+	raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+	
+	/* Zero crossing IRQ re-armed us meanwhile */
+	if (flywheel.deadline && !ktime_before(ktime_get(), flywheel.deadline)) {
+		predicted = flywheel.cycle;
+		predicted.sync = flywheel.cycle.next;
+		predicted.next = ktime_add_ns(flywheel.cycle.next, flywheel.cycle.period_ns);
+		changed = triacdrv_plan_cycle(&predicted, true);
+		irq_timestamp = ktime_add_ns(predicted.sync, predicted.optohyst_ns);
+	}
 	
-	irq_timestamp = ktime_add_ns(acline_get_sync_timestamp(), acline_get_optohyst());
+	raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
 	
-	if (neg_phase_ns) {
-		/* Begin TRIAC trigger on negative cycle */
-		neg_trigger_timestamp = ktime_add_ns(irq_timestamp, neg_phase_ns);
-		set_current_state(TASK_UNINTERRUPTIBLE);
-		schedule_hrtimeout(&neg_trigger_timestamp, HRTIMER_MODE_ABS);
-		triacdrv_trigger_pulse(neg_phase_ns);
+	if (changed)
+		triacdrv_notify();
+	if (irq_timestamp)
+		triacdrv_shm_publish(irq_timestamp, predicted.period_ns);
+	
+	return HRTIMER_NORESTART;
+}
+
+/* Zero crossing handler, called from aclinedrv IRQ handler once sync
+ * timestamp and period are updated for this cycle, both filtered while
+ * aclinedrv tracking filter is locked. Edges rejected as noise never
+ * get here, flywheel plans those cycles from prediction instead.
+ */
+static void triacdrv_zero_crossing(void)
+{
+	struct acline_snapshot acline;
+	unsigned long flags;
+	bool changed = false;
+	s64 offset;
+	
+	acline_get_snapshot(&acline);
+	
+	raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+	
+	/* Edge came after flywheel already planned its cycle: keep that
+	 * plan, only track real crossing again
+	 */
+	offset = ktime_to_ns(ktime_sub(acline.sync, flywheel.cycle.sync));
+	if (flywheel.cycles && acline.period_ns && abs(offset) < acline.period_ns / 2) {
+		flywheel.cycle = acline;
+		flywheel.cycles = 0;
+		triacdrv_flywheel_arm();
+		raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+		return;
 	}
 	
-	if (pos_phase_ns) {
-		/* Begin TRIAC trigger on positive cycle */
-		pos_trigger_timestamp = ktime_add_ns(irq_timestamp, (pos_phase_ns + period_ns / 2));
-		set_current_state(TASK_UNINTERRUPTIBLE);
-		schedule_hrtimeout(&pos_trigger_timestamp, HRTIMER_MODE_ABS);
-		triacdrv_trigger_pulse(pos_phase_ns);
+	changed = triacdrv_plan_cycle(&acline, false);
+	
+	raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+	
+	/* Wake up /dev/triacd pollers outside raw spinlock */
+	if (changed)
+		triacdrv_notify();
+	
+	triacdrv_shm_publish(ktime_add_ns(acline.sync, acline.optohyst_ns), acline.period_ns);
+
+	return;
+}
+
+
+
+/* debugfs section. triacdrv/jitter shows trigger delay statistics of
+ * every channel, writing anything to it resets them
+ */
+static int triacdrv_jitter_show(struct seq_file *s, void *data)
+{
+	struct triac_jitter jitter;
+	unsigned long flags;
+	unsigned int i, b;
+	
+	for (i = 0; i < channel_count; i++) {
+		raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+		jitter = channels[i].jitter;
+		raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+		
+		seq_printf(s, "%s: %llu triggers, min %lluns, mean %lluns, max %lluns, %llu over %uus\n",
+				channels[i].name, jitter.count, jitter.min_ns,
+				jitter.count ? div64_u64(jitter.sum_ns, jitter.count) : 0,
+				jitter.max_ns, jitter.late, JITTER_LATE_NS / USEC_TO_NANOSEC);
+		
+		for (b = 0; b < JITTER_BUCKETS; b++) {
+			if (!jitter.hist[b])
+				continue;
+			if (b == JITTER_BUCKETS - 1)
+				seq_printf(s, "\t>= %lluns\t%u\n", 1ULL << (b - 1), jitter.hist[b]);
+			else
+				seq_printf(s, "\t<  %lluns\t%u\n", 1ULL << b, jitter.hist[b]);
+		}
 	}
+	
+	return 0;
+}
 
-	return (irq_handler_t)IRQ_HANDLED;
+static int triacdrv_jitter_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, triacdrv_jitter_show, NULL);
+}
+
+static ssize_t triacdrv_jitter_reset(struct file *file, const char __user *buff, size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+	unsigned int i;
+	
+	raw_spin_lock_irqsave(&trigger_chain.lock, flags);
+	for (i = 0; i < channel_count; i++)
+		memset(&channels[i].jitter, 0, sizeof(struct triac_jitter));
+	raw_spin_unlock_irqrestore(&trigger_chain.lock, flags);
+	
+	return count;
+}
+
+/* Statistics are optional, module works without debugfs */
+static void triacdrv_debugfs_start(void)
+{
+	triacdrv_debugfs = debugfs_create_dir(JITTER_DIR, NULL);
+	debugfs_create_file(JITTER_FILE, 0644, triacdrv_debugfs, NULL, &triacdrv_jitter_fops);
+	
+	return;
+}
+
+static void triacdrv_debugfs_end(void)
+{
+	debugfs_remove_recursive(triacdrv_debugfs);
+	return;
+}
+
+
+
+/* Channel list section. One channel is created for every
+ * GPIO on gpio parameter, named after name parameter
+ */
+static int triacdrv_parse_channels(void)
+{
+	char *gpio_list, *name_list;
+	char *gpio_cursor, *name_cursor;
+	char *token;
+	const char *c;
+	unsigned int i;
+	int err = 0;
+	
+	for (c = gpio, channel_count = 1; *c; c++)
+		if (*c == ',')
+			channel_count++;
+	
+	channels = kcalloc(channel_count, sizeof(struct triac_channel), GFP_KERNEL);
+	trigger_chain.size = EVENTS_PER_CHANNEL * channel_count;
+	trigger_chain.events = kcalloc(trigger_chain.size, sizeof(struct triac_event), GFP_KERNEL);
+	gpio_list = kstrdup(gpio, GFP_KERNEL);
+	name_list = kstrdup(name, GFP_KERNEL);
+	if (!channels || !trigger_chain.events || !gpio_list || !name_list) {
+		err = -ENOMEM;
+		goto out;
+	}
+	
+	gpio_cursor = gpio_list;
+	name_cursor = name_list;
+	for (i = 0; i < channel_count; i++) {
+		token = strsep(&gpio_cursor, ",");
+		if (kstrtouint(token, 10, &channels[i].gpio)) {
+			printk(KERN_ERR "triacdrv: wrong GPIO \"%s\"\n", token);
+			err = -EINVAL;
+			goto out;
+		}
+		
+		token = strsep(&name_cursor, ",");
+		if (token && *token)
+			strscpy(channels[i].name, token, TRIAC_NAME_LEN);
+		else
+			snprintf(channels[i].name, TRIAC_NAME_LEN, "TRIAC%u", i + 1);
+	}
+	
+out:
+	kfree(gpio_list);
+	kfree(name_list);
+	if (err) {
+		kfree(trigger_chain.events);
+		kfree(channels);
+	}
+	return err;
 }
 
 
@@ -234,20 +1043,32 @@ static irq_handler_t triacdrv_gpio_irq_handler_thread(unsigned int irq, void *de
  */
 static int triacdrv_gpio_start(void)
 {
-	if (gpio_request_one(gpio, GPIOF_OUT_INIT_LOW, name)) {
-		printk(KERN_ERR "%s: GPIO error\n", name);
-		return -EIO;
-	}
-	else {
-		atomic_set(&phase.pos, pos);
-		atomic_set(&phase.neg, neg);
-		return 0;
+	unsigned int i;
+	
+	for (i = 0; i < channel_count; i++) {
+		if (gpio_request_one(channels[i].gpio, GPIOF_OUT_INIT_LOW, channels[i].name)) {
+			printk(KERN_ERR "%s: GPIO error\n", channels[i].name);
+			triacdrv_gpio_end(i);
+			return -EIO;
+		}
+		atomic_set(&channels[i].phase.pos, pos);
+		atomic_set(&channels[i].phase.neg, neg);
+		atomic_set(&channels[i].staged.pos, pos);
+		atomic_set(&channels[i].staged.neg, neg);
+		atomic_set(&channels[i].pulse_ns, clamp(pulse, MIN_PULSE_US, MAX_PULSE_US) * USEC_TO_NANOSEC);
 	}
+	
+	return 0;
 }
 
-static void triacdrv_gpio_end(void)
+static void triacdrv_gpio_end(unsigned int count)
 {
-	gpio_free(gpio);
+	unsigned int i;
+	
+	for (i = 0; i < count; i++) {
+		gpio_set_value(channels[i].gpio, 0);
+		gpio_free(channels[i].gpio);
+	}
 
 	return;
 }
@@ -257,8 +1078,13 @@ static void triacdrv_gpio_end(void)
  */
 static int __init triacdrv_init(void)
 {
+	unsigned int i;
 	int err;
 	
+	err = triacdrv_parse_channels();
+	if (err)
+		goto fail_parse; //Critical fail
+	
 	err = triacdrv_gpio_start();
 	if (err)
 		goto fail_gpio; //Critical fail
@@ -266,27 +1092,41 @@ static int __init triacdrv_init(void)
 	err = triacdrv_sysfs_start();
 	if (err)
 		goto fail_sysfs; //Critical fail
+	
+	err = triacdrv_dev_start();
+	if (err)
+		goto fail_dev;
 		
 	err = triacdrv_irq_start();
 	if (err)
 		goto fail_irq;
-		
-	printk(KERN_INFO "%s: ready\n", name);
+	
+	triacdrv_debugfs_start();
+	
+	for (i = 0; i < channel_count; i++)
+		printk(KERN_INFO "%s: ready\n", channels[i].name);
 	return 0;
 	
-	fail_irq:		triacdrv_sysfs_end();
-	fail_sysfs:		triacdrv_gpio_end();
-	fail_gpio:		printk(KERN_ERR "%s: failed to initialize\n", name);
+	fail_irq:		triacdrv_dev_end();
+	fail_dev:		triacdrv_sysfs_end(channel_count);
+	fail_sysfs:		triacdrv_gpio_end(channel_count);
+	fail_gpio:		kfree(trigger_chain.events);
+					kfree(channels);
+	fail_parse:		printk(KERN_ERR "triacdrv: failed to initialize\n");
 					return err;
 }
 
 static void __exit triacdrv_exit(void)
 {
+	triacdrv_debugfs_end();
 	triacdrv_irq_end();
-	triacdrv_sysfs_end();
-	triacdrv_gpio_end();
+	triacdrv_dev_end();
+	triacdrv_sysfs_end(channel_count);
+	triacdrv_gpio_end(channel_count);
+	kfree(trigger_chain.events);
+	kfree(channels);
 	
-	printk(KERN_INFO "%s: stopped\n", name);
+	printk(KERN_INFO "triacdrv: %u channels stopped\n", channel_count);
 	
 	return;
 }
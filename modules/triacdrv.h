@@ -13,12 +13,29 @@
 #include <linux/sysfs.h>
 #include <linux/device.h>
 #include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "acline.h"
+#include "triacdrv_ioctl.h"
+#include "timing.h"
 
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Victor Preatoni");
 MODULE_DESCRIPTION("OpenIndoor Opto-TRIAC phase driver");
-MODULE_VERSION("0.1");
+MODULE_VERSION("0.2");
 
 static const struct of_device_id triac_of_match[] = {
 	{ .compatible = "triacboard,quadtriac,dualtriac", },
@@ -26,78 +43,264 @@ static const struct of_device_id triac_of_match[] = {
 };
 MODULE_DEVICE_TABLE(of, triac_of_match);
 
-/* Sets name, GPIO pin and positive and negative phase conduction angles
- * eg: insmod triac1drv.ko name=mytriac gpio=6 pos=40 neg=30
+/* Sets channel names, GPIO pins and initial positive and negative phase
+ * conduction angles. One channel is created for every GPIO on the list.
+ * eg: insmod triacdrv.ko name=TRIAC1,TRIAC2 gpio=6,13 pos=40 neg=30
  */
 static char *name = "TRIAC1";
-module_param(name, charp, 0);
-MODULE_PARM_DESC(name, "Sets GPIO friendly name. \"TRIAC1\" by default.");
+module_param(name, charp, 0444);
+MODULE_PARM_DESC(name, "Comma separated GPIO friendly names. \"TRIACn\" by default.");
 
-static unsigned int gpio = 26;
-module_param(gpio, uint, 0);
-MODULE_PARM_DESC(gpio, "Sets ARM GPIO output pin connected to TRIAC. GPIO26 by default.");
+static char *gpio = "26";
+module_param(gpio, charp, 0444);
+MODULE_PARM_DESC(gpio, "Comma separated ARM GPIO output pins connected to TRIACs. GPIO26 by default.");
 
 static unsigned int pos = 0;
 module_param(pos, uint, 0);
-MODULE_PARM_DESC(pos, "Sets TRIAC positive cycle conduction angle. MIN=0 MAX=180 degrees.");
+MODULE_PARM_DESC(pos, "Sets TRIACs positive cycle conduction angle. MIN=0 MAX=180 degrees.");
 
 static unsigned int neg = 0;
 module_param(neg, uint, 0);
-MODULE_PARM_DESC(neg, "Sets TRIAC negative cycle conduction angle. MIN=0 MAX=180 degrees.");
-
-/* External functions exported from aclinedrv.ko */
-extern unsigned int acline_get_period(void);
-extern unsigned int acline_get_optohyst(void);
-extern ktime_t acline_get_sync_timestamp(void);
-extern unsigned int acline_get_irq(void);
-extern struct kobject * acline_get_kobject(void);
-
-
-/* Time conversion constants */
-#define USEC_TO_NANOSEC			1000U
-#define MSEC_TO_NANOSEC			(1000U * USEC_TO_NANOSEC)
-#define SEC_TO_NANOSEC			(1000U * MSEC_TO_NANOSEC)
-
-/* TRIAC pulse definitions */
-#define HIGH_CONDUCTION_ANGLE	1500U * USEC_TO_NANOSEC
-#define TRIAC_TRIGGER_PULSE		10U //us
-#define TRIAC_LONG_PULSE		500U //us
-/* Phase guard degrees
- * eg: how many degrees close to edge
- * values will be ignored
+MODULE_PARM_DESC(neg, "Sets TRIACs negative cycle conduction angle. MIN=0 MAX=180 degrees.");
+
+/* Gate pulse width can be changed per channel at runtime
+ * on /sys/triacd/<name>_pulse
+ */
+static unsigned int pulse = 100;
+module_param(pulse, uint, 0);
+MODULE_PARM_DESC(pulse, "Sets initial TRIAC trigger pulse width in microseconds. MIN=5 MAX=2000, 100us by default.");
+
+/* Trigger chain slots per channel: rising and falling edges
+ * for both cycles, plus same amount left over from previous cycle
+ */
+#define EVENTS_PER_CHANNEL		8
+/* In-kernel fades. Angles are kept in fixed point with
+ * FADE_SHIFT fractional bits while ramping
  */
-#define PHASE_GUARD				7
+#define FADE_SHIFT				16
+#define FADE_ROUND(x)			(((x) + (1 << (FADE_SHIFT - 1))) >> FADE_SHIFT)
+#define MAX_FADE_MS				(3600U * 1000U)
+/* Used to compute fade steps before first period measurement */
+#define DEFAULT_PERIOD_NS		(20U * MSEC_TO_NANOSEC)
+/* Trigger jitter histogram: bucket N counts delays from 2^(N-1)
+ * up to 2^N ns, last bucket takes anything longer
+ */
+#define JITTER_BUCKETS			24
+/* Triggers this late are also counted apart */
+#define JITTER_LATE_NS			(100U * USEC_TO_NANOSEC)
+#define JITTER_DIR				"triacdrv"
+#define JITTER_FILE				"jitter"
+/* Flywheel fires this long after latest edge aclinedrv would still
+ * accept for a predicted zero crossing
+ */
+#define FLYWHEEL_SLACK_NS		(100U * USEC_TO_NANOSEC)
+/* Cycles planned from prediction in a row, before giving up on mains */
+#define FLYWHEEL_MAX_CYCLES		5
+/* Channel name length, including terminator */
+#define TRIAC_NAME_LEN			16
+#define TRIAC_PULSE_SUFFIX		"_pulse"
 
 /* Declared atomic to avoid mutexes */
 struct triac_phase_atomic {
 	atomic_t pos; /* Positive phase conduction */
 	atomic_t neg; /* Negative phase conduction */
-} phase;
+};
+
+/* Fade in progress, stepped on every half cycle from zero crossing IRQ.
+ * steps is how many half cycles are left
+ */
+struct triac_fade {
+	bool active;
+	unsigned int steps;
+	int pos;
+	int neg;
+	int pos_step;
+	int neg_step;
+	unsigned int pos_target;
+	unsigned int neg_target;
+};
+
+/* Delay from scheduled to actual rising edge of every trigger pulse.
+ * Updated from timer callback, under trigger chain lock
+ */
+struct triac_jitter {
+	u64 count;
+	u64 sum_ns;
+	u64 min_ns;
+	u64 max_ns;
+	u64 late;
+	u32 hist[JITTER_BUCKETS];
+};
+
+/* TRIAC channel
+ * staged holds angles written from user-mode. They are copied
+ * to phase on zero crossing, unless an aclinedrv batch window is open
+ */
+struct triac_channel {
+	char name[TRIAC_NAME_LEN];
+	unsigned int gpio;
+	struct triac_phase_atomic phase;
+	struct triac_phase_atomic staged;
+	struct kobj_attribute sysfs;
+	/* Trigger pulse width */
+	atomic_t pulse_ns;
+	char pulse_name[TRIAC_NAME_LEN + sizeof(TRIAC_PULSE_SUFFIX)];
+	struct kobj_attribute sysfs_pulse;
+	/* Current cycle plan, zero means no trigger */
+	unsigned int pos_phase_ns;
+	unsigned int neg_phase_ns;
+	/* Fully on or off, GPIO is driven without triggers */
+	bool steady;
+	/* Protected by trigger chain lock */
+	struct triac_fade fade;
+	struct triac_jitter jitter;
+	/* Shared page slot, NULL if channel does not fit on it,
+	 * and serial of last setpoint taken from it
+	 */
+	struct triacd_shm_channel *shm;
+	u32 shm_serial;
+};
+
+/* A single GPIO edge on trigger chain */
+struct triac_event {
+	ktime_t timestamp;
+	struct triac_channel *channel;
+	int level;
+};
+
+/* Trigger chain. Armed from zero crossing IRQ, fired by
+ * hrtimer callback. head is next event to fire
+ */
+static struct triac_schedule {
+	struct hrtimer timer;
+	raw_spinlock_t lock;
+	struct triac_event *events;
+	unsigned int head;
+	unsigned int count;
+	unsigned int size;
+} trigger_chain;
+
+/* Flywheel. Armed past every predicted zero crossing, so if that
+ * edge is rejected as noise or goes missing, cycle is still planned
+ * from prediction. cycle is last planned one, and cycles counts
+ * those planned from prediction in a row.
+ * Protected by trigger chain lock
+ */
+static struct triac_flywheel {
+	struct hrtimer timer;
+	struct acline_snapshot cycle;
+	ktime_t deadline;
+	unsigned int cycles;
+} flywheel;
+
+static struct triac_channel *channels;
+static unsigned int channel_count;
+
+/* Setpoint changes. generation is incremented every time a new
+ * setpoint takes effect on a zero crossing, and /dev/triacd pollers
+ * are woken up
+ */
+static atomic_t generation;
+static DECLARE_WAIT_QUEUE_HEAD(generation_wq);
+
+/* Page shared with user-mode, and last seq taken from it */
+static struct triacd_shm *shm;
+static u32 shm_seq;
+/* Slots copied from shared page before seq is checked again.
+ * Only used under trigger chain lock
+ */
+static struct triacd_shm_channel shm_snapshot[TRIACD_SHM_CHANNELS];
 
 static struct kobject *triacdrv_kobject;
 
+/* debugfs directory, holding jitter statistics */
+static struct dentry *triacdrv_debugfs;
+
 
 /* TRIAC IRQ functions */
-static void triacdrv_trigger_pulse(unsigned int phase_ns);
-static unsigned int triacdrv_phase_to_ns(unsigned int phase, unsigned int period_ns);
+static unsigned int triacdrv_pulse_ns(struct triac_channel *ch, unsigned int phase_ns, unsigned int period_ns);
+static void triacdrv_shm_take(void);
+static void triacdrv_shm_publish(ktime_t sync_timestamp, unsigned int period_ns);
+static void triacdrv_fade_step(struct triac_fade *fade);
+static bool triacdrv_plan_channel(struct triac_channel *ch, unsigned int period_ns, bool hold);
+static void triacdrv_add_trigger(ktime_t timestamp, unsigned int pulse_ns, struct triac_channel *ch);
+static int triacdrv_event_cmp(const void *a, const void *b);
+static void triacdrv_jitter_record(struct triac_jitter *jitter, ktime_t scheduled, ktime_t fired);
+static enum hrtimer_restart triacdrv_timer_callback(struct hrtimer *timer);
+static bool triacdrv_plan_cycle(const struct acline_snapshot *acline, bool predicted);
+static void triacdrv_flywheel_arm(void);
+static enum hrtimer_restart triacdrv_flywheel_callback(struct hrtimer *timer);
 static int triacdrv_irq_start(void);
 static void triacdrv_irq_end(void);
-static irq_handler_t triacdrv_gpio_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static irq_handler_t triacdrv_gpio_irq_handler_thread(unsigned int irq, void *dev_id, struct pt_regs *regs);
+static void triacdrv_zero_crossing(void);
 
 
 /* SYSFS functions */
 static int triacdrv_sysfs_start(void);
-static void triacdrv_sysfs_end(void);
+static void triacdrv_sysfs_end(unsigned int count);
 static ssize_t triacdrv_set(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count);
 static ssize_t triacdrv_get(struct kobject *kobj, struct kobj_attribute *attr, char *buff);
+static ssize_t triacdrv_set_pulse(struct kobject *kobj, struct kobj_attribute *attr, const char *buff, size_t count);
+static ssize_t triacdrv_get_pulse(struct kobject *kobj, struct kobj_attribute *attr, char *buff);
 
-static struct kobj_attribute sysfs = __ATTR(triac0, 0664, triacdrv_get, triacdrv_set);
+
+/* Character device functions */
+static int triacdrv_check_setpoints(const struct triacd_setpoint *sp, unsigned int count);
+static void triacdrv_apply_setpoints(const struct triacd_setpoint *sp, unsigned int count);
+static unsigned int triacdrv_read_setpoints(struct triacd_setpoint *sp, unsigned int count);
+static int triacdrv_check_fades(const struct triacd_fade *fade, unsigned int count);
+static void triacdrv_start_fades(const struct triacd_fade *fade, unsigned int count);
+static u32 triacdrv_fading(void);
+static void triacdrv_notify(void);
+static int triacdrv_dev_open(struct inode *inode, struct file *file);
+static ssize_t triacdrv_dev_read(struct file *file, char __user *buff, size_t count, loff_t *ppos);
+static ssize_t triacdrv_dev_write(struct file *file, const char __user *buff, size_t count, loff_t *ppos);
+static __poll_t triacdrv_dev_poll(struct file *file, poll_table *wait);
+static long triacdrv_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int triacdrv_dev_mmap(struct file *file, struct vm_area_struct *vma);
+static int triacdrv_dev_start(void);
+static void triacdrv_dev_end(void);
+
+static const struct file_operations triacdrv_fops = {
+	.owner = THIS_MODULE,
+	.open = triacdrv_dev_open,
+	.read = triacdrv_dev_read,
+	.write = triacdrv_dev_write,
+	.poll = triacdrv_dev_poll,
+	.unlocked_ioctl = triacdrv_dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = triacdrv_dev_mmap,
+};
+
+static struct miscdevice triacdrv_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "triacd",
+	.fops = &triacdrv_fops,
+	.mode = 0660,
+};
+
+
+/* debugfs functions */
+static int triacdrv_jitter_show(struct seq_file *s, void *data);
+static int triacdrv_jitter_open(struct inode *inode, struct file *file);
+static ssize_t triacdrv_jitter_reset(struct file *file, const char __user *buff, size_t count, loff_t *ppos);
+static void triacdrv_debugfs_start(void);
+static void triacdrv_debugfs_end(void);
+
+static const struct file_operations triacdrv_jitter_fops = {
+	.owner = THIS_MODULE,
+	.open = triacdrv_jitter_open,
+	.read = seq_read,
+	.write = triacdrv_jitter_reset,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
 
 /* INIT functions */
+static int triacdrv_parse_channels(void);
 static int triacdrv_gpio_start(void);
-static void triacdrv_gpio_end(void);
+static void triacdrv_gpio_end(unsigned int count);
 
 static int __init triacdrv_init(void);
 static void __exit triacdrv_exit(void);
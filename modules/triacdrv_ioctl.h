@@ -0,0 +1,103 @@
+#ifndef TRIACDRV_IOCTL_H
+#define TRIACDRV_IOCTL_H
+
+/* Binary interface to triacdrv.ko, shared by Kernel module and
+ * user-mode triacd daemon
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Character device node */
+#define TRIACD_DEVICE			"/dev/triacd"
+
+/* Maximum setpoints on a single TRIACD_IOC_SET / TRIACD_IOC_GET call */
+#define TRIACD_MAX_SETPOINTS	32
+
+/* Conduction angles for a single channel.
+ * channel is 0-based, following triacdrv gpio parameter order
+ */
+struct triacd_setpoint {
+	__u32 channel;
+	__u32 pos;
+	__u32 neg;
+};
+
+/* Several channels, all applied on the same zero crossing */
+struct triacd_setpoints {
+	__u32 count;
+	struct triacd_setpoint setpoint[TRIACD_MAX_SETPOINTS];
+};
+
+struct triacd_info {
+	/* Number of channels driven by triacdrv */
+	__u32 channels;
+	/* Incremented every time a new setpoint takes effect
+	 * or a fade ends
+	 */
+	__u32 generation;
+	/* Channels with a fade in progress, bit N is channel N */
+	__u32 fading;
+};
+
+/* In-kernel fade. Conduction angles are ramped from current ones up to
+ * pos/neg in time_ms, one step on every AC half cycle.
+ * time_ms zero stops a running fade, keeping current angles.
+ * A setpoint sent to the channel also stops it
+ */
+struct triacd_fade {
+	__u32 channel;
+	__u32 pos;
+	__u32 neg;
+	__u32 time_ms;
+};
+
+/* Several fades, all started on the same zero crossing */
+struct triacd_fades {
+	__u32 count;
+	struct triacd_fade fade[TRIACD_MAX_SETPOINTS];
+};
+
+/* Shared page. mmap() /dev/triacd at offset 0 to get it.
+ * User-mode updates setpoints without any syscall: seq is incremented
+ * to an odd value, pos/neg are written and slot serial is incremented,
+ * then seq is incremented again to an even value. triacdrv takes new
+ * setpoints on next zero crossing if seq is even and changed since last
+ * time, only from slots whose serial changed.
+ * Fields marked (K) are written by triacdrv only, for monitoring.
+ */
+#define TRIACD_SHM_CHANNELS		32
+
+struct triacd_shm_channel {
+	__u32 pos;
+	__u32 neg;
+	__u32 serial;
+	/* (K) Non-zero while an in-kernel fade is in progress */
+	__u32 fading;
+	/* (K) Conduction angles on current AC cycle */
+	__u32 active_pos;
+	__u32 active_neg;
+	/* (K) CLOCK_MONOTONIC time of last trigger pulse, ns */
+	__u64 trigger_ns;
+};
+
+struct triacd_shm {
+	__u32 seq;
+	/* (K) Number of channels driven by triacdrv */
+	__u32 channels;
+	/* (K) Measured AC mains period, ns */
+	__u32 period_ns;
+	/* (K) Same as struct triacd_info generation */
+	__u32 generation;
+	/* (K) CLOCK_MONOTONIC time of last zero crossing, ns */
+	__u64 sync_ns;
+	struct triacd_shm_channel channel[TRIACD_SHM_CHANNELS];
+};
+
+#define TRIACD_IOC_MAGIC		'T'
+#define TRIACD_IOC_INFO			_IOR(TRIACD_IOC_MAGIC, 0, struct triacd_info)
+#define TRIACD_IOC_SET			_IOW(TRIACD_IOC_MAGIC, 1, struct triacd_setpoints)
+#define TRIACD_IOC_GET			_IOR(TRIACD_IOC_MAGIC, 2, struct triacd_setpoints)
+#define TRIACD_IOC_FADE			_IOW(TRIACD_IOC_MAGIC, 3, struct triacd_fades)
+
+#endif // TRIACDRV_IOCTL_H
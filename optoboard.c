@@ -1,44 +1,189 @@
 #include "optoboard.h"
 
 
-/* Loads aclinedrv kernel module */
-int board_start_acline(unsigned int pin)
+/* Prints time elapsed on a startup phase, and starts next one */
+void board_phase(const char *name, struct timespec *start)
 {
-	char module[128];
-
-	sprintf(module, "modprobe aclinedrv opto_input=%u", pin);
+	struct timespec now;
+	long long elapsed_us;
 	
-	if (system(module))
-		return EXIT_FAILURE;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+	fprintf(FPRINTF_FD, "board_init_channels: %s - %lld.%03lldms\n", name, elapsed_us / 1000, elapsed_us % 1000);
+	*start = now;
 	
-	return 0;
+	return;
+}
+
+/* Loads aclinedrv kernel module. Cached optocoupler hysteresis (us)
+ * and mains period (ns) are passed along if not zero
+ */
+int board_start_acline(unsigned int pin, unsigned int optohyst, unsigned int period)
+{
+	char params[128];
+	int len;
+
+	len = snprintf(params, sizeof(params), "opto_input=%u", pin);
+	if (optohyst)
+		snprintf(params + len, sizeof(params) - len, " optohyst=%u period=%u", optohyst, period);
+	
+	return backend_load_module("aclinedrv", params);
 }
 
 void board_stop_acline(void)
 {
-	system("rmmod aclinedrv");
+	backend_unload_module("aclinedrv");
 	return;
 }
 
-/* Loads triacNdrv kernel module */
-int board_start_triacdrv(unsigned int n, unsigned int pin, char *name)
+/* Reads HAT EEPROM serial, so a calibration cache is never used
+ * with a different board
+ */
+int board_read_serial(void)
 {
-	char module[128];
+	int fd;
+	ssize_t len;
+	char filename[512];
 	
-	sprintf(module, "modprobe triac%udrv gpio=%u pos=%u neg=%u name=%s", n, pin, 0, 0, name);
+	hat_serial[0] = '\0';
 	
-	if (system(module))
+	snprintf(filename, sizeof(filename), "%s%s", backend_root(), HAT_SERIAL_FILE);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
 		return EXIT_FAILURE;
+	len = read(fd, hat_serial, sizeof(hat_serial) - 1);
+	close(fd);
+	
+	if (len <= 0) {
+		hat_serial[0] = '\0';
+		return EXIT_FAILURE;
+	}
+	
+	/* device-tree strings come NUL terminated */
+	hat_serial[len] = '\0';
 	
 	return 0;
 }
 
-void board_stop_triacdrv(unsigned int n)
+/* Reads calibration cache. Fails if it does not exist,
+ * belongs to another board or is too old
+ */
+int board_load_calibration(unsigned int *optohyst, unsigned int *period)
 {
-	char module[128];
+	FILE *fp;
+	char line[128];
+	char filename[512];
+	char serial[sizeof(hat_serial)] = "";
+	long long timestamp = 0;
+	long long now = time(NULL);
+	
+	*optohyst = 0;
+	*period = 0;
+	
+	if (!hat_serial[0])
+		return EXIT_FAILURE;
+	
+	snprintf(filename, sizeof(filename), "%s%s/%s", backend_root(), STATE_DIR, STATE_FILE);
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+		return EXIT_FAILURE;
 	
-	sprintf(module, "rmmod triac%udrv", n);
-	system(module);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "serial=%63s", serial) == 1)
+			continue;
+		if (sscanf(line, "timestamp=%lld", &timestamp) == 1)
+			continue;
+		if (sscanf(line, "optohyst_us=%u", optohyst) == 1)
+			continue;
+		sscanf(line, "period_ns=%u", period);
+	}
+	fclose(fp);
+	
+	/* Clock going backwards (eg: no RTC yet) does not expire it */
+	if (strcmp(serial, hat_serial) || !*optohyst || (now > timestamp && now - timestamp > STATE_MAX_AGE)) {
+		*optohyst = 0;
+		*period = 0;
+		return EXIT_FAILURE;
+	}
+	
+	return 0;
+}
+
+/* Writes calibration cache from aclinedrv live values. Hysteresis is
+ * only stored once aclinedrv calibrated or confirmed it
+ */
+void board_save_calibration(void)
+{
+	FILE *fp;
+	int fd;
+	ssize_t len;
+	char buffer[64];
+	char filename[512];
+	char tmpname[512];
+	unsigned int optohyst = 0, period = 0;
+	
+	if (!hat_serial[0])
+		return;
+	
+	snprintf(filename, sizeof(filename), "%s%s/%s", backend_root(), MODULE_DIR, MODULE_OPTOHYST_FILE);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	len = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buffer[len] = '\0';
+	
+	/* Flagged "(default)" or "(cached)" while not calibrated yet */
+	if (sscanf(buffer, "%u", &optohyst) != 1 || strchr(buffer, '(')) {
+		fprintf(FPRINTF_FD, "board_save_calibration: optocoupler not calibrated yet, cache not updated\n");
+		return;
+	}
+	
+	snprintf(filename, sizeof(filename), "%s%s", backend_root(), ACLINE_PERIOD_PARAM);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		len = read(fd, buffer, sizeof(buffer) - 1);
+		if (len > 0) {
+			buffer[len] = '\0';
+			sscanf(buffer, "%u", &period);
+		}
+		close(fd);
+	}
+	
+	/* Write a new file and rename it, so cache is never left half written */
+	snprintf(filename, sizeof(filename), "%s%s", backend_root(), STATE_DIR);
+	mkdir(filename, 0755);
+	snprintf(filename, sizeof(filename), "%s%s/%s", backend_root(), STATE_DIR, STATE_FILE);
+	snprintf(tmpname, sizeof(tmpname), "%s%s/%s.tmp", backend_root(), STATE_DIR, STATE_FILE);
+	fp = fopen(tmpname, "w");
+	if (fp == NULL) {
+		fprintf(FPRINTF_FD, "board_save_calibration: error - %s\n", strerror(errno));
+		return;
+	}
+	fprintf(fp, "serial=%s\ntimestamp=%lld\noptohyst_us=%u\nperiod_ns=%u\n", hat_serial, (long long)time(NULL), optohyst, period);
+	if (fclose(fp) || rename(tmpname, filename))
+		fprintf(FPRINTF_FD, "board_save_calibration: error - %s\n", strerror(errno));
+	
+	return;
+}
+
+/* Loads triacdrv kernel module for all channels at once
+ * pins and names are comma separated lists, one item per channel
+ */
+int board_start_triacdrv(char *pins, char *names)
+{
+	char params[512];
+	
+	snprintf(params, sizeof(params), "gpio=%s name=%s pos=%u neg=%u", pins, names, 0, 0);
+	
+	return backend_load_module("triacdrv", params);
+}
+
+void board_stop_triacdrv(void)
+{
+	backend_unload_module("triacdrv");
 	return;
 }
 
@@ -46,21 +191,38 @@ void board_stop_triacdrv(unsigned int n)
  * This function is used to avoid exposing struct triac_status to triacd.c
  * triacd.c will parse required parameters and pass them to us
  */
-void board_update_channel(unsigned int n, bool fade, unsigned int time, unsigned int pos, unsigned int neg)
+void board_update_channel(unsigned int n, bool fade, unsigned int time, unsigned int pos, unsigned int neg, unsigned int curve)
 {
 	unsigned int i = n - 1;
 	 
 	if (triac[i].gpio.status == enabled) {
-		if (fade)
+		if (fade) {
+			/* triacdrv steps linear fades itself on every half cycle.
+			 * Other curves need fader tables
+			 */
+			if ((curve == CURVE_LINEAR || !time) && !board_fade_channel(i, time, pos, neg))
+				return;
 			if (!time)
 				fader_stop(i);
-			else
-				fader_start(i, time, pos, neg);
+			else {
+				/* A linear fade may still run inside triacdrv */
+				board_stop_fade(i);
+				fader_start(i, time, pos, neg, curve);
+			}
+		}
 		else {
 			fader_stop(i);
 			triac[i].phase.pos = pos;
 			triac[i].phase.neg = neg;
 			triac[i].phase.refresh = true;
+			/* Send it even if state did not change, so triacdrv
+			 * stops the fade
+			 */
+			if (triac[i].gpio.index < 32 && (dev_fading & (1U << triac[i].gpio.index))) {
+				dev_fading &= ~(1U << triac[i].gpio.index);
+				statem_sync(i, pos, neg);
+				statem_send_command(i, pos, neg);
+			}
 		}
 	}
 	
@@ -76,13 +238,22 @@ void board_update_channel(unsigned int n, bool fade, unsigned int time, unsigned
 unsigned int board_init_channels(void)
 {
 	unsigned int i, channels, version, gpio_pin;
+	unsigned int optohyst, period;
+	struct timespec begin, phase;
+	bool warm;
 	
 	int fd;
 	char buffer[128];
-	char filename[128];
+	char filename[512];
+	char pins[256] = "";
+	char names[256] = "";
+	size_t pins_len = 0, names_len = 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	phase = begin;
 	
 	/* Read vendor string */
-	sprintf(filename, "%s/%s", HAT_DIR, HAT_VENDOR_FILE);
+	sprintf(filename, "%s%s/%s", backend_root(), HAT_DIR, HAT_VENDOR_FILE);
 	fd = open(filename, O_RDONLY);
 	if (read(fd, buffer, sizeof(buffer)) == -1)
 		goto read_error;
@@ -91,7 +262,7 @@ unsigned int board_init_channels(void)
 	close(fd);
 	
 	/* Read product string */
-	sprintf(filename, "%s/%s", HAT_DIR, HAT_PRODUCT_FILE);
+	sprintf(filename, "%s%s/%s", backend_root(), HAT_DIR, HAT_PRODUCT_FILE);
 	fd = open(filename, O_RDONLY);
 	if (read(fd, buffer, sizeof(buffer)) == -1)
 		goto read_error;
@@ -100,37 +271,61 @@ unsigned int board_init_channels(void)
 	close(fd);
 
 	/* Read HAT version uint32 */
-	sprintf(filename, "%s/%s", HAT_DIR, HAT_VERSION_FILE);
+	sprintf(filename, "%s%s/%s", backend_root(), HAT_DIR, HAT_VERSION_FILE);
 	fd = open(filename, O_RDONLY);
 	if (read(fd, &version, sizeof(version)) == -1)
 		goto read_error;
 	else
 		fprintf(FPRINTF_FD, "\tv%u.%u\n", (ntohl(version) & 0x0000FF00) >> 8, (ntohl(version) & 0x000000FF));
 	close(fd);
+	
+	if (board_read_serial())
+		fprintf(FPRINTF_FD, "board_init_channels: HAT has no serial, calibration cache disabled\n");
+	board_phase("HAT detection", &phase);
 
 	
 	/* Read input channels uint32 */
-	sprintf(filename, "%s/%s/%s", HAT_DIR, HAT_INPUTS_DIR, HAT_IO_CHANNELS);
+	sprintf(filename, "%s%s/%s/%s", backend_root(), HAT_DIR, HAT_INPUTS_DIR, HAT_IO_CHANNELS);
 	fd = open(filename, O_RDONLY);
 	if (read(fd, &channels, sizeof(channels)) == -1)
 		goto read_error;
 	close(fd);
 	
 	/* Read input channel N pin */
-	sprintf(filename, "%s/%s/%u/%s", HAT_DIR, HAT_INPUTS_DIR, ntohl(channels), HAT_GPIO_PIN);
+	sprintf(filename, "%s%s/%s/%u/%s", backend_root(), HAT_DIR, HAT_INPUTS_DIR, ntohl(channels), HAT_GPIO_PIN);
 	fd = open(filename, O_RDONLY);
 	if (read(fd, &gpio_pin, sizeof(gpio_pin)) == -1)
 		goto read_error;
 	close(fd);
 	
-	if (board_start_acline(ntohl(gpio_pin)))
-		fprintf(FPRINTF_FD, "board_init_channels error: no input pin found\n");
-	else
-		fprintf(FPRINTF_FD, "board_init_channels: input pin found - %02u\n", ntohl(gpio_pin));
+	/* Warm restart: modules left loaded by a previous daemon
+	 * keep driving outputs, they are adopted as they are
+	 */
+	warm = backend_module_loaded("triacdrv");
+	
+	/* A running aclinedrv is already calibrated */
+	if (backend_module_loaded("aclinedrv"))
+		fprintf(FPRINTF_FD, "board_init_channels: aclinedrv already loaded, keeping its calibration\n");
+	else {
+		if (board_load_calibration(&optohyst, &period))
+			fprintf(FPRINTF_FD, "board_init_channels: no calibration cache, starting from default\n");
+		else
+			fprintf(FPRINTF_FD, "board_init_channels: cached calibration - %uus hysteresis, %uns period\n", optohyst, period);
+		
+		if (board_start_acline(ntohl(gpio_pin), optohyst, period))
+			fprintf(FPRINTF_FD, "board_init_channels error: no input pin found\n");
+		else
+			fprintf(FPRINTF_FD, "board_init_channels: input pin found - %02u\n", ntohl(gpio_pin));
+	}
+	board_phase("aclinedrv load", &phase);
+	
+	/* Older aclinedrv modules have no batch window */
+	sprintf(filename, "%s%s/%s", backend_root(), MODULE_DIR, MODULE_BATCH_FILE);
+	batch_fd = open(filename, O_WRONLY | O_CLOEXEC);
 	
 	
 	/* Read output channels uint32 */
-	sprintf(filename, "%s/%s/%s", HAT_DIR, HAT_OUTPUTS_DIR, HAT_IO_CHANNELS);
+	sprintf(filename, "%s%s/%s/%s", backend_root(), HAT_DIR, HAT_OUTPUTS_DIR, HAT_IO_CHANNELS);
 	fd = open(filename, O_RDONLY);
 	if (read(fd, &triac_status_len, sizeof(triac_status_len)) == -1)
 		goto read_error;
@@ -145,8 +340,9 @@ unsigned int board_init_channels(void)
 		goto ptr_error;
 	
 	for (i = 0, channels = 0; i < triac_status_len; i++) {
+		triac[i].sysfs_fd = -1;
 		/* Read output channel N pin */
-		sprintf(filename, "%s/%s/%u/%s", HAT_DIR, HAT_OUTPUTS_DIR, (i + 1), HAT_GPIO_PIN);
+		sprintf(filename, "%s%s/%s/%u/%s", backend_root(), HAT_DIR, HAT_OUTPUTS_DIR, (i + 1), HAT_GPIO_PIN);
 		fd = open(filename, O_RDONLY);
 		if (read(fd, &gpio_pin, sizeof(gpio_pin)) == -1) {
 			triac[i].gpio.status = error;
@@ -159,23 +355,52 @@ unsigned int board_init_channels(void)
 			triac[i].phase.neg = 0;
 			triac[i].phase.status = off;
 			/* Read output channel N name */
-			sprintf(filename, "%s/%s/%u/%s", HAT_DIR, HAT_OUTPUTS_DIR, (i + 1), HAT_GPIO_LABEL);
+			sprintf(filename, "%s%s/%s/%u/%s", backend_root(), HAT_DIR, HAT_OUTPUTS_DIR, (i + 1), HAT_GPIO_LABEL);
 			fd = open(filename, O_RDONLY);
 			if (read(fd, triac[i].gpio.label, sizeof(triac[i].gpio.label)) == -1)
 				sprintf(triac[i].gpio.label, "nnn%u", i + 1);
 			close(fd);
 			
-			if (board_start_triacdrv(i + 1, triac[i].gpio.pin, triac[i].gpio.label)) {
-				fprintf(FPRINTF_FD, "board_init_channels: error - cannot start triac%udrv module\n", i + 1);
-				triac[i].gpio.status = error;
-			}
-			else {
-				triac[i].gpio.status = enabled;
-				channels++;
-			}
+			/* Append channel to triacdrv parameter lists */
+			pins_len += snprintf(pins + pins_len, sizeof(pins) - pins_len, "%s%u", channels ? "," : "", triac[i].gpio.pin);
+			names_len += snprintf(names + names_len, sizeof(names) - names_len, "%s%s", channels ? "," : "", triac[i].gpio.label);
+			triac[i].gpio.status = enabled;
+			triac[i].gpio.index = channels;
+			channels++;
 		}
 	}
-		
+	
+	board_phase("output channels scan", &phase);
+	
+	/* Module loaded for another channel set (eg: EEPROM changed)
+	 * cannot be adopted
+	 */
+	if (channels && warm && board_adopt_channels()) {
+		fprintf(FPRINTF_FD, "board_init_channels: loaded triacdrv drives other channels, reloading it\n");
+		board_stop_triacdrv();
+		warm = false;
+	}
+	else if (channels && warm)
+		fprintf(FPRINTF_FD, "board_init_channels: warm restart, triacdrv already loaded\n");
+	
+	/* Single triacdrv module drives all channels */
+	if (channels && !warm && board_start_triacdrv(pins, names)) {
+		fprintf(FPRINTF_FD, "board_init_channels: error - cannot start triacdrv module\n");
+		for (i = 0; i < triac_status_len; i++)
+			if (triac[i].gpio.status == enabled)
+				triac[i].gpio.status = error;
+		channels = 0;
+	}
+	board_phase("triacdrv load", &phase);
+	
+	for (i = 0; i < triac_status_len; i++)
+		if (triac[i].gpio.status == enabled && board_open_channel(i))
+			fprintf(FPRINTF_FD, "board_init_channels: cannot open %s%s/%s yet\n", backend_root(), MODULE_DIR, triac[i].gpio.label);
+	
+	if (channels && board_open_device(channels))
+		fprintf(FPRINTF_FD, "board_init_channels: %s not available, using sysfs\n", TRIACD_DEVICE);
+	board_phase("channels open", &phase);
+	board_phase("total", &begin);
 
 	fader_init(triac, triac_status_len);
 	return channels;
@@ -192,8 +417,90 @@ ptr_error:
 	return 0;
 }
 
-/* Releases all channels, stops Kernel modules */
-void board_free_channels(void)
+/* Reads channel setpoints back from triacdrv sysfs node, and takes
+ * them as current state, so nothing is sent to outputs.
+ * Fails if any channel has no node: module was loaded for other channels
+ */
+int board_adopt_channels(void)
+{
+	unsigned int i, pos, neg;
+	
+	for (i = 0; i < triac_status_len; i++) {
+		if (triac[i].gpio.status != enabled)
+			continue;
+		if (board_read_channel(i, &pos, &neg))
+			goto adopt_error;
+		statem_sync(i, pos, neg);
+		fprintf(FPRINTF_FD, "board_adopt_channels: channel %u - %u/%u deg\n", i + 1, pos, neg);
+	}
+	
+	return 0;
+	
+adopt_error:
+	for (i = 0; i < triac_status_len; i++)
+		if (triac[i].gpio.status == enabled)
+			statem_sync(i, 0, 0);
+	return EXIT_FAILURE;
+}
+
+int board_read_channel(unsigned int i, unsigned int *pos, unsigned int *neg)
+{
+	return board_read_node(triac[i].gpio.label, pos, neg);
+}
+
+/* Reads current angles of a triacdrv sysfs node */
+int board_read_node(const char *label, unsigned int *pos, unsigned int *neg)
+{
+	int fd;
+	ssize_t len;
+	char buffer[32];
+	char filename[512];
+	
+	snprintf(filename, sizeof(filename), "%s%s/%s", backend_root(), MODULE_DIR, label);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return EXIT_FAILURE;
+	len = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (len <= 0)
+		return EXIT_FAILURE;
+	buffer[len] = '\0';
+	
+	if (sscanf(buffer, "%u %u", pos, neg) != 2 || *pos > 180 || *neg > 180)
+		return EXIT_FAILURE;
+	
+	return 0;
+}
+
+/* Reads current angles of HAT output channel n (from 1), by its
+ * device-tree label. Used by clients, with no channel set up
+ */
+int board_query_channel(unsigned int n, unsigned int *pos, unsigned int *neg)
+{
+	int fd;
+	ssize_t len;
+	char label[sizeof(triac[0].gpio.label)];
+	char filename[512];
+	
+	snprintf(filename, sizeof(filename), "%s%s%s/%u/%s", backend_root(), HAT_DIR, HAT_OUTPUTS_DIR, n, HAT_GPIO_LABEL);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return EXIT_FAILURE;
+	len = read(fd, label, sizeof(label) - 1);
+	close(fd);
+	if (len <= 0)
+		return EXIT_FAILURE;
+	/* Device-tree strings come NUL terminated already */
+	label[len] = '\0';
+	label[strcspn(label, "\n")] = '\0';
+	
+	return board_read_node(label, pos, neg);
+}
+
+/* Releases all channels. Kernel modules are only stopped if unload
+ * is set, otherwise they keep outputs as they are for a warm restart
+ */
+void board_free_channels(bool unload)
 {
 	unsigned int i;
 	
@@ -201,13 +508,25 @@ void board_free_channels(void)
 	
 	for (i = 0; i < triac_status_len; i++) {
 		if (triac[i].gpio.status == enabled) {
-			board_stop_triacdrv(i + 1);
+			board_close_channel(i);
 			triac[i].gpio.status = disabled;
 			fprintf(FPRINTF_FD, "board_free_channels: channel %u released\n", i + 1);
 		}
 	}
 	
-	board_stop_acline();
+	/* Open device holds a reference on triacdrv.ko */
+	board_close_device();
+	if (batch_fd != -1) {
+		close(batch_fd);
+		batch_fd = -1;
+	}
+	board_save_calibration();
+	if (unload) {
+		board_stop_triacdrv();
+		board_stop_acline();
+	}
+	else
+		fprintf(FPRINTF_FD, "board_free_channels: Kernel modules left loaded, outputs unchanged\n");
 	
 	free(triac);
 	
@@ -216,32 +535,329 @@ void board_free_channels(void)
 
 
 
-/* Sends command to /sysfs triac channel */
-int statem_send_command(char *name, unsigned int pos, unsigned int neg)
+/* Opens channel sysfs node once, so updates do not need
+ * a path lookup + open + close every time
+ */
+int board_open_channel(unsigned int i)
 {
-	int fd;
-	char params[128];
-	char filename[128];
+	char filename[512];
+	
+	board_close_channel(i);
 	
-	sprintf(params, "%u %u", pos, neg);
-	sprintf(filename, "%s/%s", MODULE_DIR, name);
-	fd = open(filename, O_WRONLY);
-	if (write(fd, params, strlen(params)) <= 0) {
-		fprintf(FPRINTF_FD, "statem_send_command error: %d - %s\n", errno, strerror(errno));
+	sprintf(filename, "%s%s/%s", backend_root(), MODULE_DIR, triac[i].gpio.label);
+	triac[i].sysfs_fd = open(filename, O_WRONLY | O_CLOEXEC);
+	if (triac[i].sysfs_fd == -1)
 		return EXIT_FAILURE;
+	
+	return 0;
+}
+
+void board_close_channel(unsigned int i)
+{
+	if (triac[i].sysfs_fd != -1) {
+		close(triac[i].sysfs_fd);
+		triac[i].sysfs_fd = -1;
+	}
+	
+	return;
+}
+
+/* Opens triacdrv character device and checks it drives
+ * the expected number of channels
+ */
+int board_open_device(unsigned int channels)
+{
+	struct triacd_info info;
+	char filename[512];
+	
+	board_close_device();
+	
+	/* Fake boards have no device, sysfs is used */
+	snprintf(filename, sizeof(filename), "%s%s", backend_root(), TRIACD_DEVICE);
+	dev_fd = open(filename, O_RDWR | O_CLOEXEC);
+	if (dev_fd == -1)
+		return EXIT_FAILURE;
+	
+	if (ioctl(dev_fd, TRIACD_IOC_INFO, &info) == -1 || info.channels != channels) {
+		board_close_device();
+		return EXIT_FAILURE;
+	}
+	
+	/* Fades left running by a previous daemon */
+	dev_fading = info.fading;
+	
+	/* Shared page is optional, write() is used without it */
+	dev_shm = mmap(NULL, sizeof(struct triacd_shm), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, 0);
+	if (dev_shm == MAP_FAILED || channels > TRIACD_SHM_CHANNELS) {
+		if (dev_shm != MAP_FAILED)
+			munmap(dev_shm, sizeof(struct triacd_shm));
+		dev_shm = NULL;
+		fprintf(FPRINTF_FD, "board_open_device: shared page not available\n");
+	}
+	
+	return 0;
+}
+
+void board_close_device(void)
+{
+	if (dev_shm) {
+		munmap(dev_shm, sizeof(struct triacd_shm));
+		dev_shm = NULL;
+		shm_dirty = false;
+	}
+	if (dev_fd != -1) {
+		close(dev_fd);
+		dev_fd = -1;
+	}
+	dev_out_len = 0;
+	dev_fades_len = 0;
+	dev_fading = 0;
+	
+	return;
+}
+
+/* triacdrv character device descriptor, for main loop to watch.
+ * -1 if not available
+ */
+int board_get_fd(void)
+{
+	return dev_fd;
+}
+
+/* Character device is readable: a setpoint took effect or a fade ended.
+ * Channels whose fade ended are synced with triacdrv angles
+ */
+void board_handle_event(void)
+{
+	struct triacd_info info;
+	struct triacd_setpoints sps;
+	unsigned int ended;
+	unsigned int i, n;
+	
+	if (ioctl(dev_fd, TRIACD_IOC_INFO, &info) == -1)
+		return;
+	
+	ended = dev_fading & ~info.fading;
+	if (!ended)
+		return;
+	dev_fading &= info.fading;
+	
+	if (ioctl(dev_fd, TRIACD_IOC_GET, &sps) == -1)
+		return;
+	
+	for (i = 0; i < triac_status_len; i++) {
+		if (triac[i].gpio.status != enabled || !(ended & (1U << triac[i].gpio.index)))
+			continue;
+		for (n = 0; n < sps.count; n++)
+			if (sps.setpoint[n].channel == triac[i].gpio.index)
+				statem_sync(i, sps.setpoint[n].pos, sps.setpoint[n].neg);
+		fprintf(FPRINTF_FD, "board_handle_event: fade ended on channel %u - %u %u\n", i + 1, triac[i].phase.pos, triac[i].phase.neg);
+	}
+	
+	return;
+}
+
+/* Queues a fade to run inside triacdrv, started on statem_flush_commands().
+ * Channel state is moved to fade target right away, so statem_loop()
+ * does not send anything for it.
+ * Returns EXIT_FAILURE if user-mode fader must be used instead
+ */
+int board_fade_channel(unsigned int i, unsigned int time, unsigned int pos, unsigned int neg)
+{
+	unsigned int n;
+	unsigned int index = triac[i].gpio.index;
+	
+	if (dev_fd == -1 || index >= 32)
+		return EXIT_FAILURE;
+	
+	/* Stop a user-mode fade that was running before */
+	fader_stop(i);
+	
+	for (n = 0; n < dev_fades_len; n++)
+		if (dev_fades[n].channel == index)
+			break;
+	if (n == TRIACD_MAX_SETPOINTS)
+		return EXIT_FAILURE;
+	dev_fades[n].channel = index;
+	dev_fades[n].pos = pos;
+	dev_fades[n].neg = neg;
+	dev_fades[n].time_ms = time;
+	if (n == dev_fades_len)
+		dev_fades_len++;
+	
+	if (time) {
+		dev_fading |= 1U << index;
+		statem_sync(i, pos, neg);
+	}
+	
+	return 0;
+}
+
+/* Stops a fade running inside triacdrv right away, and syncs
+ * channel state with angles where it stopped
+ */
+void board_stop_fade(unsigned int i)
+{
+	struct triacd_fades fades;
+	struct triacd_setpoints sps;
+	unsigned int n;
+	unsigned int index = triac[i].gpio.index;
+	
+	if (dev_fd == -1 || index >= 32 || !(dev_fading & (1U << index)))
+		return;
+	dev_fading &= ~(1U << index);
+	
+	memset(&fades, 0, sizeof(fades));
+	fades.count = 1;
+	fades.fade[0].channel = index;
+	if (ioctl(dev_fd, TRIACD_IOC_FADE, &fades) == -1 || ioctl(dev_fd, TRIACD_IOC_GET, &sps) == -1) {
+		fprintf(FPRINTF_FD, "board_stop_fade error: %d - %s\n", errno, strerror(errno));
+		return;
 	}
-// 	fprintf(FPRINTF_FD, "statem_send_command: %s %s\n", filename, params);
-	close(fd);
+	
+	for (n = 0; n < sps.count; n++)
+		if (sps.setpoint[n].channel == index)
+			statem_sync(i, sps.setpoint[n].pos, sps.setpoint[n].neg);
+	
+	return;
+}
+
+/* Batch window: while open, TRIAC modules keep applying previous
+ * phase angles. Every channel written inside the window is applied
+ * on the first zero crossing after board_batch_commit()
+ */
+void board_batch_begin(void)
+{
+	/* Not needed with character device, a single write() is atomic */
+	if (batch_fd != -1 && dev_fd == -1)
+		pwrite(batch_fd, "1", 1, 0);
+	
+	return;
+}
+
+void board_batch_commit(void)
+{
+	if (batch_fd != -1 && dev_fd == -1)
+		pwrite(batch_fd, "0", 1, 0);
+	
+	return;
+}
+
+/* Sends command to triac channel
+ * With shared page, command is stored there and published on
+ * statem_flush_commands(), so no syscall at all.
+ * With character device, command is queued until statem_flush_commands().
+ * Otherwise it goes to /sysfs node. If module was reloaded, old sysfs
+ * descriptor is stale (ENODEV), so node is reopened and write retried once
+ */
+int statem_send_command(unsigned int i, unsigned int pos, unsigned int neg)
+{
+	int len;
+	unsigned int n;
+	char params[128];
+	
+	if (dev_shm) {
+		/* Odd seq tells triacdrv an update is in progress */
+		if (!shm_dirty) {
+			__atomic_store_n(&dev_shm->seq, dev_shm->seq + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			shm_dirty = true;
+		}
+		dev_shm->channel[triac[i].gpio.index].pos = pos;
+		dev_shm->channel[triac[i].gpio.index].neg = neg;
+		/* Serial goes last, so triacdrv never pairs it with older pos/neg */
+		__atomic_store_n(&dev_shm->channel[triac[i].gpio.index].serial,
+						 dev_shm->channel[triac[i].gpio.index].serial + 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+	
+	if (dev_fd != -1) {
+		/* Newest command wins if channel was already queued */
+		for (n = 0; n < dev_out_len; n++)
+			if (dev_out[n].channel == triac[i].gpio.index)
+				break;
+		if (n == TRIACD_MAX_SETPOINTS)
+			return EXIT_FAILURE;
+		dev_out[n].channel = triac[i].gpio.index;
+		dev_out[n].pos = pos;
+		dev_out[n].neg = neg;
+		if (n == dev_out_len)
+			dev_out_len++;
+		return 0;
+	}
+	
+	len = sprintf(params, "%u %u", pos, neg);
+	
+	if (triac[i].sysfs_fd == -1 || pwrite(triac[i].sysfs_fd, params, len, 0) <= 0) {
+		if (board_open_channel(i) || pwrite(triac[i].sysfs_fd, params, len, 0) <= 0) {
+			fprintf(FPRINTF_FD, "statem_send_command error: %d - %s\n", errno, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+// 	fprintf(FPRINTF_FD, "statem_send_command: %s %s\n", triac[i].gpio.label, params);
 	
 	return 0;
 }
 
+/* Publishes every queued command with an even seq on shared page,
+ * or sends them on a single write().
+ * triacdrv applies all of them on the same zero crossing.
+ * Queued fades go last, so setpoints sent before cannot stop them
+ */
+void statem_flush_commands(void)
+{
+	struct triacd_fades fades;
+	
+	if (shm_dirty) {
+		__atomic_store_n(&dev_shm->seq, dev_shm->seq + 1, __ATOMIC_RELEASE);
+		shm_dirty = false;
+	}
+	
+	if (dev_fd == -1)
+		return;
+	
+	if (dev_out_len && write(dev_fd, dev_out, dev_out_len * sizeof(struct triacd_setpoint)) == -1)
+		fprintf(FPRINTF_FD, "statem_flush_commands error: %d - %s\n", errno, strerror(errno));
+	dev_out_len = 0;
+	
+	if (dev_fades_len) {
+		fades.count = dev_fades_len;
+		memcpy(fades.fade, dev_fades, dev_fades_len * sizeof(struct triacd_fade));
+		if (ioctl(dev_fd, TRIACD_IOC_FADE, &fades) == -1)
+			fprintf(FPRINTF_FD, "statem_flush_commands fade error: %d - %s\n", errno, strerror(errno));
+		dev_fades_len = 0;
+	}
+	
+	return;
+}
+
+/* Updates channel state to angles triacdrv already has (eg: a fade
+ * running inside it), without sending any command
+ */
+void statem_sync(unsigned int i, unsigned int pos, unsigned int neg)
+{
+	triac[i].phase.pos = pos;
+	triac[i].phase.neg = neg;
+	triac[i].phase.refresh = false;
+	
+	if (pos == 0 && neg == 0)
+		triac[i].phase.status = off;
+	else if (pos == 180 && neg == 180)
+		triac[i].phase.status = on;
+	else if (pos == neg)
+		triac[i].phase.status = sym;
+	else
+		triac[i].phase.status = asym;
+	
+	return;
+}
+
 void statem_set_off(unsigned int i)
 {
 	triac[i].phase.status = off;
 	triac[i].phase.pos = 0;
 	triac[i].phase.neg = 0;
-	statem_send_command(triac[i].gpio.label, 0, 0);
+	statem_send_command(i, 0, 0);
 	
 	return;
 }
@@ -252,7 +868,7 @@ void statem_set_on(unsigned int i)
 	triac[i].phase.status = on;
 	triac[i].phase.pos = 180;
 	triac[i].phase.neg = 180;
-	statem_send_command(triac[i].gpio.label, 180, 180);
+	statem_send_command(i, 180, 180);
 	
 	return;
 }
@@ -260,7 +876,7 @@ void statem_set_on(unsigned int i)
 void statem_set_sym(unsigned int i, unsigned int phase)
 {
 	triac[i].phase.status = sym;
-	statem_send_command(triac[i].gpio.label, phase, phase);
+	statem_send_command(i, phase, phase);
 	
 	return;
 }
@@ -268,7 +884,7 @@ void statem_set_sym(unsigned int i, unsigned int phase)
 void statem_set_asym(unsigned int i, unsigned int pos, unsigned int neg)
 {
 	triac[i].phase.status = asym;
-	statem_send_command(triac[i].gpio.label, pos, neg);
+	statem_send_command(i, pos, neg);
 	
 	return;
 }
@@ -300,15 +916,17 @@ void statem_loop(void)
 						break;
 					}
 					
+					/* Asymmetric angles may have one half cycle
+					 * fully off or on (eg: mean mode)
+					 */
+					if (local_neg != local_pos) {
+						statem_set_asym(i, local_pos, local_neg);
+						break;
+					}
+					
 					if (local_pos < 180 && local_pos > 0) {
-						if (local_neg == local_pos) {
-							statem_set_sym(i, local_pos);
-							break;
-						}
-						else {
-							statem_set_asym(i, local_pos, local_neg);
-							break;
-						}
+						statem_set_sym(i, local_pos);
+						break;
 					}
 					
 					/* no state change */
@@ -320,15 +938,14 @@ void statem_loop(void)
 						break;
 					}
 					
+					if (local_neg != local_pos) {
+						statem_set_asym(i, local_pos, local_neg);
+						break;
+					}
+					
 					if (local_pos < 180 && local_pos > 0) {
-						if (local_neg == local_pos) {
-							statem_set_sym(i, local_pos);
-							break;
-						}
-						else {
-							statem_set_asym(i, local_pos, local_neg);
-							break;
-						}
+						statem_set_sym(i, local_pos);
+						break;
 					}
 					
 					/* no state change */
@@ -386,5 +1003,7 @@ void statem_loop(void)
 		} //end if enabled
 	} //end for
 	
+	statem_flush_commands();
+	
 	return;
 }
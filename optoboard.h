@@ -11,22 +11,19 @@
 #include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "modules/triacdrv_ioctl.h"
+#include "tables.h"
+#include "board.h"
 
 
 /* Where to print messages */
 #define FPRINTF_FD					stdout
-/* Kernel module sysfs node */
-#define MODULE_DIR				"/sys/triacd"
-/* HAT device-tree node */
-#define HAT_DIR					"/proc/device-tree/triacboard"
-#define HAT_INPUTS_DIR			"/in"
-#define HAT_OUTPUTS_DIR			"/out"
-#define HAT_VENDOR_FILE			"vendor"
-#define HAT_PRODUCT_FILE		"product"
-#define HAT_VERSION_FILE		"version"
-#define HAT_GPIO_LABEL			"label"
-#define HAT_GPIO_PIN			"arm_gpio"
-#define HAT_IO_CHANNELS			"channels"
+/* Cache older than this is ignored, in seconds */
+#define STATE_MAX_AGE			(30 * 24 * 3600)
 
 struct triac_phase {
 	volatile unsigned int pos;
@@ -40,6 +37,8 @@ struct triac_gpio {
 	unsigned pin;
 	/* TRIAC channel friendly name, can be any */
 	char label[16];
+	/* Channel index on triacdrv.ko */
+	unsigned int index;
 	/* GPIO initialization status: disabled unless set by software */
 	enum {disabled, error, enabled} status;
 };
@@ -48,27 +47,83 @@ struct triac_gpio {
 struct triac_status {
 	struct triac_gpio gpio;
 	struct triac_phase phase;
+	/* Persistent sysfs node descriptor, -1 if closed */
+	int sysfs_fd;
 };
 
 struct triac_status *triac;
 unsigned int triac_status_len;
 
+/* HAT serial, empty if EEPROM has none */
+static char hat_serial[64] = "";
+
+/* Batch window sysfs node descriptor, -1 if not supported */
+static int batch_fd = -1;
+
+/* triacdrv character device descriptor, -1 if not supported.
+ * When available, setpoints of a statem_loop() pass are packed
+ * and sent with a single write()
+ */
+static int dev_fd = -1;
+static struct triacd_setpoint dev_out[TRIACD_MAX_SETPOINTS];
+static unsigned int dev_out_len = 0;
+
+/* triacdrv shared page, NULL if not mapped.
+ * When available, setpoints are stored there and no syscall is needed.
+ * shm_dirty is set while an update is open (odd seq)
+ */
+static struct triacd_shm *dev_shm = NULL;
+static bool shm_dirty = false;
 
-extern void fader_start(unsigned int, unsigned int, unsigned int, unsigned int);
+/* Fades run inside triacdrv when character device is available.
+ * They are queued like setpoints and started on a single ioctl().
+ * dev_fading holds channels (triacdrv index bits) still ramping
+ */
+static struct triacd_fade dev_fades[TRIACD_MAX_SETPOINTS];
+static unsigned int dev_fades_len = 0;
+static unsigned int dev_fading = 0;
+
+
+extern void fader_start(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int);
 extern void fader_stop(unsigned int);
 extern void fader_init(struct triac_status *, unsigned int);
 extern void fader_release(void);
+extern const char *backend_root(void);
+extern int backend_load_module(const char *, const char *);
+extern void backend_unload_module(const char *);
+extern bool backend_module_loaded(const char *);
 
-int board_start_acline(unsigned int);
+void board_phase(const char *, struct timespec *);
+int board_start_acline(unsigned int, unsigned int, unsigned int);
 void board_stop_acline(void);
+int board_read_serial(void);
+int board_load_calibration(unsigned int *, unsigned int *);
+void board_save_calibration(void);
 unsigned int board_init_channels(void);
-void board_free_channels(void);
-int board_start_triacdrv(unsigned int, unsigned int, char *);
-void board_stop_triacdrv(unsigned int);
-void board_update_channel(unsigned int, bool, unsigned int, unsigned int, unsigned int);
+void board_free_channels(bool);
+int board_adopt_channels(void);
+int board_read_channel(unsigned int, unsigned int *, unsigned int *);
+int board_read_node(const char *, unsigned int *, unsigned int *);
+int board_query_channel(unsigned int, unsigned int *, unsigned int *);
+int board_start_triacdrv(char *, char *);
+void board_stop_triacdrv(void);
+void board_update_channel(unsigned int, bool, unsigned int, unsigned int, unsigned int, unsigned int);
+
+int board_open_channel(unsigned int);
+void board_close_channel(unsigned int);
+int board_open_device(unsigned int);
+void board_close_device(void);
+void board_batch_begin(void);
+void board_batch_commit(void);
+int board_get_fd(void);
+void board_handle_event(void);
+int board_fade_channel(unsigned int, unsigned int, unsigned int, unsigned int);
+void board_stop_fade(unsigned int);
 
 void statem_loop(void);
-int statem_send_command(char *, unsigned int, unsigned int);
+int statem_send_command(unsigned int, unsigned int, unsigned int);
+void statem_flush_commands(void);
+void statem_sync(unsigned int, unsigned int, unsigned int);
 void statem_set_off(unsigned int);
 void statem_set_on(unsigned int);
 void statem_set_sym(unsigned int, unsigned int);
@@ -0,0 +1,34 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <stdint.h>
+
+/* Fade curves. Fader interpolates linearly on curve level, so
+ * level is what changes at constant speed during a fade:
+ * 		linear	conduction angle
+ * 		rms		RMS voltage
+ * 		power	delivered power
+ * 		gamma	perceived brightness, power ^ (1 / CURVE_GAMMA_EXP)
+ * 		mean	mean (DC) voltage of a half cycle
+ * Tables are generated at build time by gentables.c into tables.c,
+ * so fader needs no trig or sqrt
+ */
+enum fade_curve {CURVE_LINEAR, CURVE_RMS, CURVE_POWER, CURVE_GAMMA, CURVE_MEAN, CURVE_COUNT};
+
+#define CURVE_NAMES				{"linear", "rms", "power", "gamma", "mean"}
+#define CURVE_GAMMA_EXP			2.2
+/* Curve level is fixed point, from 0 up to CURVE_ONE */
+#define CURVE_SHIFT				16
+#define CURVE_ONE				(1U << CURVE_SHIFT)
+/* Inverse tables resolution */
+#define CURVE_POINTS			4096
+#define CURVE_MAX_ANGLE			180
+
+/* Curve level of every integer conduction angle */
+extern const uint32_t curve_level[CURVE_COUNT][CURVE_MAX_ANGLE + 1];
+/* Conduction angle of CURVE_POINTS + 1 equally spaced levels,
+ * fixed point with CURVE_SHIFT fractional bits
+ */
+extern const uint32_t curve_angle[CURVE_COUNT][CURVE_POINTS + 1];
+
+#endif //TABLES_H
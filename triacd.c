@@ -6,7 +6,7 @@
  * It can also run on stand-alone mode. Allows passing command line arguments
  * to control triacd daemon.
  * 
- * triacd will launch required kernel modules (aclinedrv.ko and triacNdrv.ko)
+ * triacd will launch required kernel modules (aclinedrv.ko and triacdrv.ko)
  * according to how many channels are configured on HAT EEPROM.
  *
  * Copyright (C) 2019 Victor Preatoni
@@ -15,36 +15,47 @@
 #include "triacd.h"
 
 
-/* SIGINT and SIGTERM catcher */
-void triacd_sigterm(int signum)
-{
-	daemon_stop = 1;
-}
-
 void triacd_print_params(char *argv)
 {
 	fprintf(FPRINTF_FD, "\nOpenIndoor Opto-TRAIC daemon control\n");
 	fprintf(FPRINTF_FD, "triacd version: %u.%u\n\n", MAJOR_VERSION, MINOR_VERSION);
 	fprintf(FPRINTF_FD, "Usage:\n");
 	fprintf(FPRINTF_FD, "No parameter\tto start triacd daemon\n");
+	fprintf(FPRINTF_FD, "-l\t\tto start triacd daemon on latency measurement mode\n");
+	fprintf(FPRINTF_FD, "-F [dir]\tto start triacd daemon on a fake board rooted at dir, no hardware needed\n");
+	fprintf(FPRINTF_FD, "\t\t* Device-tree is generated there if missing, sysfs nodes are plain files\n");
+	fprintf(FPRINTF_FD, "\t\t* Combined with any other option, talks to daemon running on that fake board\n");
 	fprintf(FPRINTF_FD, "-c [1-4]\tto select TRIAC channel\n");
-	fprintf(FPRINTF_FD, "-f\t\tto start fade-in or fade-out\n");
+	fprintf(FPRINTF_FD, "-f[curve]\tto start fade-in or fade-out\n");
+	fprintf(FPRINTF_FD, "\t\t* curve can be linear (conduction angle, default), rms (RMS voltage),\n");
+	fprintf(FPRINTF_FD, "\t\t  power (delivered power) or gamma (perceived brightness)\n");
 	fprintf(FPRINTF_FD, "-t [msec]\tto define fade-in or fade-out time\n");
 	fprintf(FPRINTF_FD, "\t\t* Fader requires a fade-time. If no conduction angle passed, fader will fade out to zero\n");
 	fprintf(FPRINTF_FD, "\t\t* If no fade-time is passed, fader will immediately stop\n");
 	fprintf(FPRINTF_FD, "-p [0-180]\tto define positive phase conduction degrees\n");
-	fprintf(FPRINTF_FD, "-n [0-180]\tto define negative phase conduction degrees\n");
+	fprintf(FPRINTF_FD, "-n [0-180]\tto define negative phase conduction degrees, not with -r, -w nor -m\n");
 	fprintf(FPRINTF_FD, "\t\t* If no negative angle passed, TRIAC will work on symmetric phase mode\n");
 	fprintf(FPRINTF_FD, "\t\t* If no negative OR positive angle passed, TRIAC will turn off\n");
+	fprintf(FPRINTF_FD, "-r [0-100[/0-100]]\tto define positive [/negative] RMS voltage percentage instead of degrees\n");
+	fprintf(FPRINTF_FD, "-w [0-100[/0-100]]\tto define positive [/negative] power percentage instead of degrees\n");
+	fprintf(FPRINTF_FD, "-m [-100-100[/0-100]]\tto define mean (DC) voltage percentage [/RMS voltage percentage]\n");
+	fprintf(FPRINTF_FD, "\t\t* 100%% mean is a full positive half-wave. Without RMS, opposite half cycle is kept off\n");
+	fprintf(FPRINTF_FD, "-q\t\tto print current conduction angles, mean voltage, RMS voltage and power of every channel\n");
+	fprintf(FPRINTF_FD, "-x\t\tto stop triacd daemon and unload Kernel modules\n");
+	fprintf(FPRINTF_FD, "\t\t* Stopping daemon with SIGTERM leaves modules loaded and outputs unchanged,\n");
+	fprintf(FPRINTF_FD, "\t\t  next daemon start adopts them (warm restart)\n");
+	fprintf(FPRINTF_FD, "-s [c=p[/n],...]\tto set several channels at once, on the same AC cycle\n");
+	fprintf(FPRINTF_FD, "\t\t* Can be combined with -f and -t to fade all of them together\n");
 	fprintf(FPRINTF_FD, "\nEg: %s -c4 -f -t5000 -p110\tto start fading channel 4 for 5sec up to 110deg\n", argv);
+	fprintf(FPRINTF_FD, "    %s -c4 -fgamma -t5000 -p180\tto fade channel 4 up to full brightness in 5sec, at perceptually even speed\n", argv);
 	fprintf(FPRINTF_FD, "    %s -c1 -p110 -n30\t\tto set channel 1 to 110deg positive / 30deg negative\n", argv);
 	fprintf(FPRINTF_FD, "    %s -c2\t\t\tto turn off channel 2\n", argv);
+	fprintf(FPRINTF_FD, "    %s -c3 -w37.5\t\tto set channel 3 heater to 37.5%% power\n", argv);
+	fprintf(FPRINTF_FD, "    %s -c2 -m-20/50\t\tto set channel 2 Peltier to -20%% mean at 50%% RMS\n", argv);
+	fprintf(FPRINTF_FD, "    %s -s1=110,2=90/30,4=0\tto set channels 1, 2 and 4 together\n", argv);
 // 	fprintf(FPRINTF_FD, "    %s -c3 -t3000\t\t\tto turn off channel 3 after 3sec\n", argv); //TODO
 // 	fprintf(FPRINTF_FD, "    %s -c1 -t20000 -p180\t\tto fully turn on channel 1 after 20sec\n", argv); //TODO
 // 	fprintf(FPRINTF_FD, "    %s -c1 -t20000 -p180\t\tto fully turn on channel 1 after 20sec\n", argv); //TODO  get frequency
-// 	fprintf(FPRINTF_FD, "    %s -c1 -t20000 -p180\t\tto fully turn on channel 1 after 20sec\n", argv); //TODO  set rms
-// 	fprintf(FPRINTF_FD, "    %s -c1 -t20000 -p180\t\tto fully turn on channel 1 after 20sec\n", argv); //TODO  get rms
-// 	fprintf(FPRINTF_FD, "    %s -c1 -t20000 -p180\t\tto fully turn on channel 1 after 20sec\n", argv); //TODO  get mean
 	return;
 }
 
@@ -58,35 +69,117 @@ int main(int argc, char *argv[])
 	int time = 0;
 	int pos_phase = 0;
 	int neg_phase = 0;
+	int neg_degrees = 0;
+	bool neg_request = false;
 	int channel = 0;
+	char *scene = NULL;
+	char *fake_root = NULL;
+	int curve = CURVE_LINEAR;
+	unsigned int unit = CURVE_LINEAR;
+	bool query = false;
+	bool shutdown = false;
+	bool client = false;
 	int opt;
 	int exit_state;
 	
 	if (argc > 1) {
-		while ((opt = getopt(argc, argv, "c:ft:p:n:")) != -1) {
+		while ((opt = getopt(argc, argv, "c:f::t:p:n:ls:r:w:m:qxF:")) != -1) {
 			switch (opt) {
 				case 'c':
+					client = true;
 					channel = atoi(optarg);
 					break;
 				case 'f':
+					client = true;
 					fade_request = true;
+					if (optarg)
+						curve = triacd_parse_curve(optarg);
+					if (curve < 0) {
+						fprintf(FPRINTF_FD, "Unknown fade curve: %s\n", optarg);
+						exit(EXIT_FAILURE);
+					}
 					break;
 				case 't':
+					client = true;
 					time = atoi(optarg);
 					break;
 				case 'p':
+					client = true;
 					pos_phase = atoi(optarg);
 					neg_phase = pos_phase;
+					unit = CURVE_LINEAR;
+					break;
+				case 'r':
+				case 'w':
+					client = true;
+					if (triacd_parse_level(optarg, &pos_phase, &neg_phase)) {
+						fprintf(FPRINTF_FD, "Percentage limit is 0-100%%\n");
+						exit(EXIT_FAILURE);
+					}
+					unit = (opt == 'r') ? CURVE_RMS : CURVE_POWER;
+					break;
+				case 'm':
+					client = true;
+					if (triacd_parse_mean(optarg, &pos_phase, &neg_phase)) {
+						fprintf(FPRINTF_FD, "Mean limit is -100-100%%, RMS limit is 0-100%%\n");
+						exit(EXIT_FAILURE);
+					}
+					unit = CURVE_MEAN;
+					break;
+				case 'q':
+					client = true;
+					query = true;
+					break;
+				case 'x':
+					client = true;
+					shutdown = true;
 					break;
 				case 'n':
-					neg_phase = atoi(optarg);
+					client = true;
+					neg_request = true;
+					neg_degrees = atoi(optarg);
+					break;
+				case 'l':
+					latency_mode = true;
+					break;
+				case 's':
+					client = true;
+					scene = optarg;
+					break;
+				case 'F':
+					fake_root = optarg;
 					break;
 				default:
 					triacd_print_params(argv[0]);
 					exit(EXIT_FAILURE);
 			}
 		}
-		exit_state = triacd_set_params(channel, fade_request, time, pos_phase, neg_phase);
+		/* -n is degrees, so it cannot go with -r, -w nor -m. Taken
+		 * after parsing, so -p does not override it whatever the order
+		 */
+		if (neg_request) {
+			if (unit != CURVE_LINEAR) {
+				fprintf(FPRINTF_FD, "-n is degrees, cannot be used with -r, -w nor -m\n");
+				exit(EXIT_FAILURE);
+			}
+			neg_phase = neg_degrees;
+		}
+		
+		/* Clients talk to a daemon running on fake board too */
+		if (fake_root && backend_init(fake_root, MAX_TRIACS))
+			exit(EXIT_FAILURE);
+		
+		/* Daemon starts only if no client action was requested */
+		if (!client)
+			exit_state = triacd_main_loop();
+		else if (shutdown)
+			exit_state = triacd_shutdown();
+		else if (query)
+			exit_state = triacd_query();
+		else if (scene)
+			exit_state = triacd_set_batch(scene, fade_request, time, curve);
+		else
+			exit_state = triacd_set_params(channel, fade_request, time, pos_phase, neg_phase, curve, unit);
 	}
 	else
 		exit_state = triacd_main_loop();
@@ -94,10 +187,69 @@ int main(int argc, char *argv[])
 	exit(exit_state);
 }
 
-/* Single-run parameter sanity-check and Message Queue sender */
-int triacd_set_params(int channel, bool fade, int time, int pos, int neg)
+/* Fade curve name to enum fade_curve, -1 if unknown */
+int triacd_parse_curve(char *name)
+{
+	const char *names[] = CURVE_NAMES;
+	int i;
+	
+	for (i = 0; i < CURVE_COUNT; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	
+	return -1;
+}
+
+/* Parses "pos[/neg]" percentages into CURVE_SHIFT fixed point levels.
+ * Negative takes positive value if not passed
+ */
+int triacd_parse_level(char *arg, int *pos, int *neg)
+{
+	float pos_pct, neg_pct;
+	
+	switch (sscanf(arg, "%f/%f", &pos_pct, &neg_pct)) {
+		case 1:
+			neg_pct = pos_pct;
+			break;
+		case 2:
+			break;
+		default:
+			return EXIT_FAILURE;
+	}
+	
+	if (pos_pct < 0 || pos_pct > 100 || neg_pct < 0 || neg_pct > 100)
+		return EXIT_FAILURE;
+	
+	*pos = (int)(pos_pct * CURVE_ONE / 100 + 0.5f);
+	*neg = (int)(neg_pct * CURVE_ONE / 100 + 0.5f);
+	
+	return 0;
+}
+
+/* Parses "mean[/rms]" percentages into CURVE_SHIFT fixed point levels.
+ * Mean can be negative, RMS is zero if not passed
+ */
+int triacd_parse_mean(char *arg, int *mean, int *rms)
+{
+	float mean_pct, rms_pct = 0;
+	
+	if (sscanf(arg, "%f/%f", &mean_pct, &rms_pct) < 1)
+		return EXIT_FAILURE;
+	
+	if (mean_pct < -100 || mean_pct > 100 || rms_pct < 0 || rms_pct > 100)
+		return EXIT_FAILURE;
+	
+	*mean = (int)(mean_pct * CURVE_ONE / 100 + (mean_pct < 0 ? -0.5f : 0.5f));
+	*rms = (int)(rms_pct * CURVE_ONE / 100 + 0.5f);
+	
+	return 0;
+}
+
+/* Single-run parameter sanity-check and Message Queue sender
+ * pos and neg are degrees, or curve levels if unit is not linear
+ */
+int triacd_set_params(int channel, bool fade, int time, int pos, int neg, unsigned int curve, unsigned int unit)
 {
-	mqd_t mq;
 	union msg_q packed_data;
 	
 	if (channel == 0) {
@@ -110,7 +262,7 @@ int triacd_set_params(int channel, bool fade, int time, int pos, int neg)
 		return EXIT_FAILURE;
 	}
 	
-	if (channel < 0 || time < 0 || pos < 0 || neg < 0) {
+	if (channel < 0 || time < 0 || (pos < 0 && unit != CURVE_MEAN) || neg < 0) {
 		fprintf(FPRINTF_FD, "Cannot use negative values!\n");
 		return EXIT_FAILURE;
 	}
@@ -120,27 +272,179 @@ int triacd_set_params(int channel, bool fade, int time, int pos, int neg)
 		return EXIT_FAILURE;
 	}
 	
-	if (pos > 180 || neg > 180) {
+	if (unit == CURVE_LINEAR && (pos > 180 || neg > 180)) {
 		fprintf(FPRINTF_FD, "Conduction angle limit is 180deg\n");
 		return EXIT_FAILURE;
 	}
 	
-	/* open the message queue only if it was previosly created by daemon*/
-	mq = mq_open(QUEUE_NAME, O_WRONLY | O_NONBLOCK);
-	if (mq == (mqd_t) -1) {
-		fprintf(FPRINTF_FD, "Message queue error: %d - %s\nIs daemon running?...\n", errno, strerror(errno));
-		return EXIT_FAILURE;
-	}
-	
+	memset(&packed_data, 0, sizeof(packed_data));
 	packed_data.triac.channel = (unsigned int)channel;
 	packed_data.triac.fade = fade;
 	packed_data.triac.time = (unsigned int)time;
+	/* Negative mean travels as two's complement */
 	packed_data.triac.pos = (unsigned int)pos;
 	packed_data.triac.neg = (unsigned int)neg;
+	packed_data.triac.curve = curve;
+	packed_data.triac.unit = unit;
+	clock_gettime(CLOCK_MONOTONIC, &packed_data.triac.sent);
+	
+	return triacd_send(&packed_data, sizeof(struct triac_data));
+}
+
+/* Single-run batch parser and sender
+ * scene format is "channel=pos[/neg]" items separated by commas
+ */
+int triacd_set_batch(char *scene, bool fade, int time, unsigned int curve)
+{
+	union msg_q packed_data;
+	char *item, *saveptr;
+	int channel, pos, neg;
+	int fields;
 	
+	if (fade && time == 0) {
+		fprintf(FPRINTF_FD, "Must define fade time: -t [msec]\n");
+		return EXIT_FAILURE;
+	}
+	
+	if (time < 0) {
+		fprintf(FPRINTF_FD, "Cannot use negative values!\n");
+		return EXIT_FAILURE;
+	}
+	
+	memset(&packed_data, 0, sizeof(packed_data));
+	packed_data.batch.magic = BATCH_MAGIC;
+	packed_data.batch.curve = curve;
+	
+	for (item = strtok_r(scene, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		fields = sscanf(item, "%d=%d/%d", &channel, &pos, &neg);
+		if (fields == 2)
+			neg = pos;
+		else if (fields != 3) {
+			fprintf(FPRINTF_FD, "Wrong channel setting: %s\n", item);
+			return EXIT_FAILURE;
+		}
+		
+		if (channel < 1 || channel > MAX_TRIACS) {
+			fprintf(FPRINTF_FD, "Channel must be 1-%u\n", MAX_TRIACS);
+			return EXIT_FAILURE;
+		}
+		
+		if (pos < 0 || neg < 0 || pos > 180 || neg > 180) {
+			fprintf(FPRINTF_FD, "Conduction angle limit is 0-180deg\n");
+			return EXIT_FAILURE;
+		}
+		
+		packed_data.batch.mask |= 1U << (channel - 1);
+		packed_data.batch.channel[channel - 1].fade = fade;
+		packed_data.batch.channel[channel - 1].time = (unsigned int)time;
+		packed_data.batch.channel[channel - 1].pos = (unsigned int)pos;
+		packed_data.batch.channel[channel - 1].neg = (unsigned int)neg;
+	}
+	
+	if (!packed_data.batch.mask) {
+		fprintf(FPRINTF_FD, "Must define at least one channel: -s c=p[/n],...\n");
+		return EXIT_FAILURE;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &packed_data.batch.sent);
+	
+	return triacd_send(&packed_data, sizeof(struct triac_batch));
+}
+
+/* Single-run query. Reads every channel angles from triacdrv and
+ * prints mean voltage, effective RMS voltage and power of the whole
+ * AC cycle.
+ * If /dev/triacd is missing (eg: fake board) or fails, channel sysfs
+ * nodes are read instead
+ */
+int triacd_query(void)
+{
+	int fd;
+	int err;
+	unsigned int i, pos, neg;
+	unsigned int found = 0;
+	struct triacd_setpoints sps;
+	char filename[512];
+	
+	snprintf(filename, sizeof(filename), "%s%s", backend_root(), TRIACD_DEVICE);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd != -1 && ioctl(fd, TRIACD_IOC_GET, &sps) != -1) {
+		close(fd);
+		for (i = 0; i < sps.count; i++)
+			if (sps.setpoint[i].pos <= 180 && sps.setpoint[i].neg <= 180)
+				triacd_print_levels(sps.setpoint[i].channel + 1, sps.setpoint[i].pos, sps.setpoint[i].neg);
+		return EXIT_SUCCESS;
+	}
+	err = errno;
+	if (fd != -1)
+		close(fd);
 	
-	if ((mq_send(mq, packed_data.message, sizeof(struct triac_data), 0)) < 0) {
+	for (i = 1; i <= MAX_TRIACS; i++) {
+		if (board_query_channel(i, &pos, &neg))
+			continue;
+		triacd_print_levels(i, pos, neg);
+		found++;
+	}
+	
+	if (!found) {
+		fprintf(FPRINTF_FD, "Query error: %d - %s\nIs triacdrv running?...\n", err, strerror(err));
+		return EXIT_FAILURE;
+	}
+	
+	return EXIT_SUCCESS;
+}
+
+/* Prints angles of a channel, with mean voltage, RMS voltage and power */
+void triacd_print_levels(unsigned int channel, unsigned int pos, unsigned int neg)
+{
+	int32_t mean;
+	uint32_t power, rms;
+	
+	fader_cycle_levels(pos, neg, &mean, &rms, &power);
+	fprintf(FPRINTF_FD, "channel %u: %u/%u deg, mean %.1f%%, RMS %.1f%%, power %.1f%%\n", channel,
+			pos, neg, mean * 100.0 / CURVE_ONE, rms * 100.0 / CURVE_ONE, power * 100.0 / CURVE_ONE);
+	
+	return;
+}
+
+/* Single-run shutdown request. Daemon stops and unloads
+ * Kernel modules
+ */
+int triacd_shutdown(void)
+{
+	union msg_q packed_data;
+	
+	memset(&packed_data, 0, sizeof(packed_data));
+	packed_data.control.magic = CONTROL_MAGIC;
+	packed_data.control.command = CONTROL_SHUTDOWN;
+	
+	return triacd_send(&packed_data, sizeof(struct triac_control));
+}
+
+/* Message Queue sender */
+int triacd_send(union msg_q *packed_data, size_t len)
+{
+	mqd_t mq;
+	struct timespec deadline;
+	
+	/* open the message queue only if it was previosly created by daemon*/
+	mq = mq_open(QUEUE_NAME, O_WRONLY);
+	if (mq == (mqd_t) -1) {
+		fprintf(FPRINTF_FD, "Message queue error: %d - %s\nIs daemon running?...\n", errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	
+	/* If queue is full, give daemon some time to drain it */
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += QUEUE_SEND_TIMEOUT;
+	if (deadline.tv_nsec >= SEC_TO_NANOSEC) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= SEC_TO_NANOSEC;
+	}
+	
+	if ((mq_timedsend(mq, packed_data->message, len, 0, &deadline)) < 0) {
 		fprintf(FPRINTF_FD, "Message queue error: %d - %s\n", errno, strerror(errno));
+		mq_close(mq);
 		return EXIT_FAILURE;
 	}
 	
@@ -156,9 +460,135 @@ void triacd_refresh_params(struct triac_data triac_params)
 {
 	int i;
 	
+	int32_t mean;
+	uint32_t rms;
+	
+	/* Mean setpoints are solved into an asymmetric angle pair */
+	if (triac_params.unit == CURVE_MEAN) {
+		fader_solve_mean((int32_t)triac_params.pos, triac_params.neg, &triac_params.pos, &triac_params.neg);
+		fader_cycle_levels(triac_params.pos, triac_params.neg, &mean, &rms, NULL);
+		fprintf(FPRINTF_FD, "channel %u: %u/%u deg, mean %.1f%%, RMS %.1f%%\n", triac_params.channel,
+				triac_params.pos, triac_params.neg, mean * 100.0 / CURVE_ONE, rms * 100.0 / CURVE_ONE);
+	}
+	/* RMS or power setpoints are converted to conduction angles */
+	else if (triac_params.unit != CURVE_LINEAR && triac_params.unit < CURVE_COUNT) {
+		triac_params.pos = fader_level_to_angle(triac_params.unit, triac_params.pos);
+		triac_params.neg = fader_level_to_angle(triac_params.unit, triac_params.neg);
+	}
+	
 	i = triac_params.channel - 1;
 	if (i < max_channels)
-		board_update_channel(triac_params.channel, triac_params.fade, triac_params.time, triac_params.pos, triac_params.neg);
+		board_update_channel(triac_params.channel, triac_params.fade, triac_params.time, triac_params.pos, triac_params.neg, triac_params.curve);
+	
+	return;
+}
+
+/* Queues a channel command, replacing any older one */
+void triacd_queue_pending(struct triac_data *triac_params)
+{
+	unsigned int i = triac_params->channel - 1;
+	
+	if (i >= MAX_TRIACS || i >= max_channels) {
+		mq_stats.dropped++;
+		return;
+	}
+	
+	if (pending[i].valid)
+		mq_stats.coalesced++;
+	pending[i].triac = *triac_params;
+	pending[i].valid = true;
+	
+	return;
+}
+
+/* Clients built before struct triac_data grew send 5 plain 32-bit
+ * fields. Build fails if legacy size ever moves away from that
+ */
+_Static_assert(MSG_Q_LEGACY_SIZE == 5 * sizeof(uint32_t), "legacy struct triac_data clients send 20 bytes");
+
+/* Reads every pending message and keeps only the newest
+ * command for each channel
+ * Batch messages are unpacked into per-channel commands
+ */
+void triacd_drain_mq(mqd_t mq)
+{
+	ssize_t len;
+	unsigned int i;
+	union msg_q packed_data;
+	struct triac_data triac_params;
+	
+	for (;;) {
+		memset(&packed_data, 0, sizeof(packed_data));
+		len = mq_receive(mq, packed_data.message, sizeof(union msg_q), NULL);
+		if (len < 0)
+			break; /* EAGAIN: queue is empty */
+		
+		mq_stats.received++;
+		
+		if (packed_data.control.magic == CONTROL_MAGIC) {
+			if (len != sizeof(struct triac_control) || packed_data.control.command != CONTROL_SHUTDOWN)
+				mq_stats.dropped++;
+			else
+				shutdown_requested = true;
+		}
+		else if (packed_data.batch.magic == BATCH_MAGIC) {
+			if (len != sizeof(struct triac_batch) && len != MSG_Q_BATCH_LEGACY_SIZE) {
+				mq_stats.dropped++;
+				continue;
+			}
+			for (i = 0; i < MAX_TRIACS; i++) {
+				if (!(packed_data.batch.mask & (1U << i)))
+					continue;
+				triac_params.channel = i + 1;
+				triac_params.fade = packed_data.batch.channel[i].fade;
+				triac_params.time = packed_data.batch.channel[i].time;
+				triac_params.pos = packed_data.batch.channel[i].pos;
+				triac_params.neg = packed_data.batch.channel[i].neg;
+				triac_params.sent = packed_data.batch.sent;
+				triac_params.curve = packed_data.batch.curve;
+				triac_params.unit = CURVE_LINEAR;
+				triacd_queue_pending(&triac_params);
+			}
+			pending_batch = true;
+		}
+		else if (len < (ssize_t)MSG_Q_LEGACY_SIZE)
+			mq_stats.dropped++;
+		else
+			triacd_queue_pending(&packed_data.triac);
+	}
+	
+	return;
+}
+
+/* Applies newest command of every channel
+ * Returns true if a batch message is among them
+ */
+bool triacd_apply_pending(void)
+{
+	unsigned int i;
+	bool batch = pending_batch;
+	
+	for (i = 0; i < MAX_TRIACS; i++)
+		if (pending[i].valid)
+			triacd_refresh_params(pending[i].triac);
+	
+	pending_batch = false;
+	
+	return batch;
+}
+
+/* Called after statem_loop() wrote applied commands to sysfs */
+void triacd_flush_pending(void)
+{
+	unsigned int i;
+	
+	for (i = 0; i < MAX_TRIACS; i++) {
+		if (pending[i].valid) {
+			if (latency_mode && !pending[i].triac.fade)
+				triacd_latency_record(&pending[i].triac.sent);
+			pending[i].valid = false;
+		}
+	}
 	
 	return;
 }
@@ -171,8 +601,9 @@ mqd_t triacd_init_mq(void)
 	mode_t omask;
 	
 	/* initialize the queue attributes */
-	attr.mq_maxmsg = 10;
-	attr.mq_msgsize = sizeof(struct triac_data);
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = QUEUE_MAXMSG;
+	attr.mq_msgsize = sizeof(union msg_q);
 	
 	/* Check if mq was already created
 	 *That means another daemon is running
@@ -184,6 +615,11 @@ mqd_t triacd_init_mq(void)
 	omask = umask(0);
 	/* create the message queue */
 	mq = mq_open(QUEUE_NAME, O_CREAT | O_RDONLY | O_NONBLOCK, 0666, &attr);
+	if (mq == (mqd_t) -1 && (errno == EINVAL || errno == EPERM)) {
+		/* Not allowed to go above system msg_max */
+		attr.mq_maxmsg = QUEUE_MAXMSG_DEFAULT;
+		mq = mq_open(QUEUE_NAME, O_CREAT | O_RDONLY | O_NONBLOCK, 0666, &attr);
+	}
 	/* restore permissions */
 	umask(omask);
 	
@@ -198,26 +634,137 @@ void triacd_end_mq(mqd_t mq)
 	return;
 }
 
-/* Signal handler installer */
-void triacd_init_signals(void)
+/* Signal handler installer
+ * SIGTERM, SIGINT and SIGUSR1 are blocked and delivered thru a signalfd,
+ * so main loop can wait for them together with the message queue
+ */
+int triacd_init_signals(void)
 {
-	struct sigaction action;
+	sigset_t mask;
 	
-	/* install signal handlers */
-	memset(&action, 0, sizeof(struct sigaction));
-	action.sa_handler = triacd_sigterm;
-	sigaction(SIGTERM, &action, NULL);
-	sigaction(SIGINT, &action, NULL);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		return -1;
+	
+	return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/* Creates epoll instance watching message queue, signals and fader timer */
+int triacd_init_epoll(mqd_t mq, int sfd, int tfd)
+{
+	int efd;
+	int fds[3] = {mq, sfd, tfd};
+	unsigned int i;
+	
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (efd == -1)
+		return -1;
+	
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (triacd_watch_fd(efd, fds[i])) {
+			close(efd);
+			return -1;
+		}
+	}
+	
+	return efd;
+}
+
+/* Adds a descriptor to epoll instance, waiting for input */
+int triacd_watch_fd(int efd, int fd)
+{
+	struct epoll_event ev;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return EXIT_FAILURE;
+	
+	return 0;
+}
+
+/* Arms fader timer for an absolute CLOCK_MONOTONIC deadline,
+ * or disarms it if deadline is NULL
+ */
+void triacd_arm_timer(int tfd, struct timespec *deadline)
+{
+	struct itimerspec its;
+	
+	memset(&its, 0, sizeof(its));
+	if (deadline)
+		its.it_value = *deadline;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
 	
 	return;
 }
+
+/* Accounts time elapsed since client sent a command */
+void triacd_latency_record(struct timespec *sent)
+{
+	struct timespec now;
+	long delta_ns;
+	
+	/* Client did not stamp the message */
+	if (!sent->tv_sec && !sent->tv_nsec)
+		return;
 	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	delta_ns = (now.tv_sec - sent->tv_sec) * SEC_TO_NANOSEC + (now.tv_nsec - sent->tv_nsec);
+	
+	if (!latency.count || delta_ns < latency.min_ns)
+		latency.min_ns = delta_ns;
+	if (!latency.count || delta_ns > latency.max_ns)
+		latency.max_ns = delta_ns;
+	latency.sum_ns += delta_ns;
+	latency.count++;
+	
+	fprintf(FPRINTF_FD, "latency: %ld.%03ldus\n", delta_ns / USEC_TO_NANOSEC, delta_ns % USEC_TO_NANOSEC);
+	
+	return;
+}
 
-/* Daemon mode main-loop */
+void triacd_latency_report(void)
+{
+	if (!latency.count)
+		return;
+	
+	fprintf(FPRINTF_FD, "latency: %lu commands, min %ldus, avg %lldus, max %ldus\n",
+			latency.count, latency.min_ns / USEC_TO_NANOSEC,
+			latency.sum_ns / latency.count / USEC_TO_NANOSEC, latency.max_ns / USEC_TO_NANOSEC);
+	
+	return;
+}
+
+/* Message queue counters, printed on exit or on SIGUSR1 */
+void triacd_stats_report(void)
+{
+	fprintf(FPRINTF_FD, "queue: %lu received, %lu coalesced, %lu dropped\n",
+			mq_stats.received, mq_stats.coalesced, mq_stats.dropped);
+	
+	return;
+}
+	
+
+/* Daemon mode main-loop
+ * Sleeps on epoll until a command, a signal or a fader refresh tick arrives
+ */
 int triacd_main_loop(void)
 {
 	mqd_t mq;
-	union msg_q packed_data;
+	int sfd, tfd, efd, bfd;
+	int i, nfds;
+	bool stop = false;
+	bool timer_armed = false;
+	struct timespec deadline;
+	bool batch;
+	uint64_t expirations;
+	struct signalfd_siginfo siginfo;
+	struct epoll_event events[MAX_EVENTS];
 	
 	
 	mq = triacd_init_mq();
@@ -226,7 +773,14 @@ int triacd_main_loop(void)
 		return(EXIT_FAILURE);
 	}
 	
-	triacd_init_signals();
+	sfd = triacd_init_signals();
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	efd = triacd_init_epoll(mq, sfd, tfd);
+	if (sfd == -1 || tfd == -1 || efd == -1) {
+		fprintf(FPRINTF_FD, "Error: cannot init event loop: %d - %s\n", errno, strerror(errno));
+		triacd_end_mq(mq);
+		return(EXIT_FAILURE);
+	}
 	
 	/* Get Opto-TRIAC board available channels and init them*/
 	max_channels = board_init_channels();
@@ -234,25 +788,85 @@ int triacd_main_loop(void)
 		fprintf(FPRINTF_FD, "%u channels configured\n", max_channels);
 	else {
 		fprintf(FPRINTF_FD, "Error: no channels configured\n\tIs EEPROM valid?\n\tAre Kernel modules installed?\n");
+		close(efd);
+		close(tfd);
+		close(sfd);
 		triacd_end_mq(mq);
 		return(EXIT_FAILURE);
 	}
 	
+	/* triacdrv reports in-kernel fades end thru its device */
+	bfd = board_get_fd();
+	if (bfd != -1 && triacd_watch_fd(efd, bfd))
+		fprintf(FPRINTF_FD, "Warning: cannot watch triacdrv device: %d - %s\n", errno, strerror(errno));
 	
 	fprintf(FPRINTF_FD, "Starting main loop...\n");
-	while (!daemon_stop) {
-		if ((mq_receive(mq, packed_data.message, sizeof(struct triac_data), NULL)) > 0)
-			triacd_refresh_params(packed_data.triac);
+	while (!stop) {
+		nfds = epoll_wait(efd, events, MAX_EVENTS, -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(FPRINTF_FD, "epoll error: %d - %s\n", errno, strerror(errno));
+			break;
+		}
 		
+		for (i = 0; i < nfds; i++) {
+			if (events[i].data.fd == sfd) {
+				if (read(sfd, &siginfo, sizeof(siginfo)) != sizeof(siginfo))
+					continue;
+				if (siginfo.ssi_signo == SIGUSR1)
+					triacd_stats_report();
+				else
+					stop = true;
+			}
+			else if (events[i].data.fd == tfd) {
+				/* Faders catch up on their own deadlines,
+				 * expirations count is not needed
+				 */
+				if (read(tfd, &expirations, sizeof(expirations)) < 0)
+					continue;
+				fader_tick();
+			}
+			else if (events[i].data.fd == mq) {
+				triacd_drain_mq(mq);
+				stop |= shutdown_requested;
+			}
+			else if (events[i].data.fd == bfd)
+				board_handle_event();
+		}
+		
+		/* Batch commands are written to sysfs inside a kernel
+		 * batch window, so they all apply on the same zero crossing
+		 */
+		batch = triacd_apply_pending();
+		if (batch)
+			board_batch_begin();
 		statem_loop();
+		if (batch)
+			board_batch_commit();
+		triacd_flush_pending();
 		
-		usleep(THREAD_LATENCY);
+		/* Wake up again on next fader step. Final fader values
+		 * were already sent by statem_loop() above
+		 */
+		if (fader_next_deadline(&deadline)) {
+			triacd_arm_timer(tfd, &deadline);
+			timer_armed = true;
+		}
+		else if (timer_armed) {
+			triacd_arm_timer(tfd, NULL);
+			timer_armed = false;
+		}
 	}
 	
-	fprintf(FPRINTF_FD, "Stopping...\n");
+	fprintf(FPRINTF_FD, shutdown_requested ? "Shutting down...\n" : "Stopping...\n");
+	triacd_stats_report();
+	if (latency_mode)
+		triacd_latency_report();
+	close(efd);
+	close(tfd);
+	close(sfd);
 	triacd_end_mq(mq);
-	board_free_channels();
+	board_free_channels(shutdown_requested);
 	return (EXIT_SUCCESS);
 }
-
-
@@ -7,10 +7,20 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <mqueue.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include "tables.h"
+#include "modules/triacdrv_ioctl.h"
 
 #define MAJOR_VERSION			0
 #define MINOR_VERSION			1
@@ -21,25 +31,58 @@
 #define FPRINTF_FD				stdout
 /* Message queue name for client-daemon IPC */
 #define QUEUE_NAME				"/triacd_q"
+/* Queue depth. Needs CAP_SYS_RESOURCE above /proc/sys/fs/mqueue/msg_max */
+#define QUEUE_MAXMSG			64
+#define QUEUE_MAXMSG_DEFAULT	10
+/* How long a client waits for room on a full queue */
+#define QUEUE_SEND_TIMEOUT		(100U * MSEC_TO_NANOSEC)
 #define BUFF_SIZE    			128
 /* Time constants */
 #define USEC_TO_NANOSEC			1000U
 #define MSEC_TO_NANOSEC			(1000U * USEC_TO_NANOSEC)
 #define SEC_TO_NANOSEC			(1000U * MSEC_TO_NANOSEC)
 #define MSEC_TO_USEC			1000U
-#define THREAD_LATENCY			(100U * MSEC_TO_USEC)
+/* Maximum epoll events processed per wakeup */
+#define MAX_EVENTS				4
 
 
+extern int backend_init(const char *, unsigned int);
+extern const char *backend_root(void);
 extern unsigned int board_init_channels(void);
-extern void board_free_channels(void);
-extern void board_update_channel(unsigned int, bool, unsigned int, unsigned int, unsigned int);
+extern void board_free_channels(bool);
+extern void board_update_channel(unsigned int, bool, unsigned int, unsigned int, unsigned int, unsigned int);
+extern int board_query_channel(unsigned int, unsigned int *, unsigned int *);
 extern void statem_loop(void);
+extern bool fader_next_deadline(struct timespec *);
+extern void fader_tick(void);
+extern unsigned int fader_level_to_angle(enum fade_curve, uint32_t);
+extern void fader_cycle_levels(unsigned int, unsigned int, int32_t *, uint32_t *, uint32_t *);
+extern void fader_solve_mean(int32_t, uint32_t, unsigned int *, unsigned int *);
+extern void board_batch_begin(void);
+extern void board_batch_commit(void);
+extern int board_get_fd(void);
+extern void board_handle_event(void);
 
 
 static unsigned int max_channels;
 
-/* Signal handler stop request */
-static volatile sig_atomic_t daemon_stop = 0;
+/* Latency measurement mode: reports command-to-sysfs time */
+static bool latency_mode = false;
+
+/* Command-to-sysfs latency statistics */
+static struct triac_latency {
+	unsigned long count;
+	long min_ns;
+	long max_ns;
+	long long sum_ns;
+} latency;
+
+/* Message queue counters */
+static struct triac_mq_stats {
+	unsigned long received;
+	unsigned long coalesced;
+	unsigned long dropped;
+} mq_stats;
 
 /* Message queue struct */
 struct triac_data {
@@ -48,21 +91,123 @@ struct triac_data {
 	unsigned int time;
 	unsigned int pos;
 	unsigned int neg;
+	/* Client send time (CLOCK_MONOTONIC), used by latency mode.
+	 * Zero if client does not fill it.
+	 */
+	struct timespec sent;
+	/* Fade curve, enum fade_curve. Linear on older clients */
+	unsigned int curve;
+	/* pos and neg units, enum fade_curve: degrees if linear,
+	 * otherwise curve level (eg: RMS fraction) in CURVE_SHIFT fixed point.
+	 * Mean unit takes a signed mean level on pos, and an optional
+	 * RMS level on neg (zero if none)
+	 */
+	unsigned int unit;
+};
+
+/* Batch message: several channels applied on the same AC cycle.
+ * magic overlaps struct triac_data.channel, so daemon can tell
+ * both formats apart.
+ */
+#define BATCH_MAGIC				0x54524942U /* "TRIB" */
+
+struct triac_batch_channel {
+	bool fade;
+	unsigned int time;
+	unsigned int pos;
+	unsigned int neg;
+};
+
+struct triac_batch {
+	unsigned int magic;
+	/* bit N-1 set means channel N is included */
+	unsigned int mask;
+	struct triac_batch_channel channel[MAX_TRIACS];
+	struct timespec sent;
+	/* Fade curve for every channel, enum fade_curve */
+	unsigned int curve;
+};
+
+/* Control message: daemon commands not tied to any channel.
+ * magic overlaps struct triac_data.channel as well
+ */
+#define CONTROL_MAGIC			0x54524943U /* "TRIC" */
+
+enum triac_control_command {
+	/* Stop daemon and unload Kernel modules. A plain SIGTERM leaves
+	 * them loaded, driving outputs, for a warm restart
+	 */
+	CONTROL_SHUTDOWN = 1,
 };
 
-/* Union to "serialize" struct triac_data */
+struct triac_control {
+	unsigned int magic;
+	unsigned int command;
+};
+
+/* Union to "serialize" struct triac_data, struct triac_batch
+ * or struct triac_control
+ */
 union msg_q {
 	struct triac_data triac;
-	char message[sizeof(struct triac_data)];
+	struct triac_batch batch;
+	struct triac_control control;
+	char message[sizeof(struct triac_batch)];
+};
+
+/* struct triac_data as sent by clients older than its sent field.
+ * Frozen: struct triac_data.sent is 8-byte aligned on most targets,
+ * so offsetof() of it does not match old message size
+ */
+struct triac_data_v0 {
+	unsigned int channel;
+	bool fade;
+	unsigned int time;
+	unsigned int pos;
+	unsigned int neg;
 };
 
-void triacd_sigterm(int);
+/* Message size sent by clients older than struct triac_data.sent */
+#define MSG_Q_LEGACY_SIZE		sizeof(struct triac_data_v0)
+/* Batch message size sent by clients older than struct triac_batch.curve */
+#define MSG_Q_BATCH_LEGACY_SIZE	offsetof(struct triac_batch, curve)
+
+/* Newest command received for each channel, pending to be applied */
+static struct triac_pending {
+	bool valid;
+	struct triac_data triac;
+} pending[MAX_TRIACS];
+
+/* A batch message is pending, apply it inside a kernel batch window */
+static bool pending_batch = false;
+
+/* Shutdown control message received */
+static bool shutdown_requested = false;
+
 int triacd_main_loop(void);
-int triacd_set_params(int, bool, int, int, int);
+int triacd_set_params(int, bool, int, int, int, unsigned int, unsigned int);
+int triacd_parse_level(char *, int *, int *);
+int triacd_parse_mean(char *, int *, int *);
+int triacd_query(void);
+void triacd_print_levels(unsigned int, unsigned int, unsigned int);
+int triacd_set_batch(char *, bool, int, unsigned int);
+int triacd_shutdown(void);
+int triacd_parse_curve(char *);
+int triacd_send(union msg_q *, size_t);
 void triacd_refresh_params(struct triac_data);
-void triacd_init_signals(void);
+int triacd_init_signals(void);
+int triacd_init_epoll(mqd_t, int, int);
+int triacd_watch_fd(int, int);
+void triacd_arm_timer(int, struct timespec *);
 mqd_t triacd_init_mq(void);
 void triacd_end_mq(mqd_t);
+void triacd_queue_pending(struct triac_data *);
+void triacd_drain_mq(mqd_t);
+bool triacd_apply_pending(void);
+void triacd_flush_pending(void);
+void triacd_latency_record(struct timespec *);
+void triacd_latency_report(void);
+void triacd_stats_report(void);
 void triacd_print_params(char *);
 
 #endif //TRIACD_H
@@ -0,0 +1,481 @@
+/*
+ * triacsim.c - AC line and TRIAC trigger timing simulator
+ * Feeds synthetic optocoupler edges to the same timing code run by
+ * aclinedrv.ko and triacdrv.ko (modules/timing.h): tracking filter,
+ * optocoupler calibration and trigger computation. Every trigger is
+ * compared against ideal firing time, computed from true mains zero
+ * crossings, and firing angle error distribution is reported.
+ *
+ * Mains frequency can drift, every edge gets gaussian noise, and
+ * optocoupler asymmetry (hysteresis) moves rising edges early and
+ * falling edges late. Glitches and missing cycles can be added too.
+ * No Kernel, hrtimer nor GPIO latency is simulated: only timing math.
+ *
+ * Copyright (C) 2019 Victor Preatoni
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "modules/timing.h"
+
+/* Where to print messages */
+#define FPRINTF_FD				stderr
+/* Simulation defaults */
+#define DEFAULT_FREQUENCY		50.0
+#define DEFAULT_SECONDS			60.0
+#define DEFAULT_ANGLE			90
+#define DEFAULT_NOISE_US		20.0
+#define DEFAULT_ASYMMETRY_US	289.0
+/* aclinedrv starts from this hysteresis until calibrated */
+#define DEFAULT_OPTOHYST_US		320U
+/* Spurious optocoupler pulse width */
+#define GLITCH_WIDTH_ns			(20U * USEC_TO_NANOSEC)
+/* Error histogram: bucket N counts errors from 2^(N-1)
+ * up to 2^N ns, last bucket takes anything larger
+ */
+#define ERROR_BUCKETS			24
+/* Edges on a single simulated cycle: optocoupler pulse and a glitch */
+#define CYCLE_EDGES				4
+
+
+/* Simulation setup, from command line */
+struct sim_params {
+	double frequency;
+	double drift;
+	double noise_us;
+	double asymmetry_us;
+	double glitch;
+	double missing;
+	double seconds;
+	unsigned int pos;
+	unsigned int neg;
+	unsigned int optohyst_us;
+	unsigned int period_ns;
+	double limit_us;
+	long seed;
+};
+
+/* aclinedrv state, same fields its IRQ handler keeps */
+static struct sim_acline {
+	ktime_t timestamp;
+	ktime_t old_timestamp;
+	ktime_t period_time;
+	struct acline_pll pll;
+	struct calib_stats high;
+	struct calib_stats low;
+	ktime_t falling;
+	unsigned int opto_hysteresis;
+	unsigned int cached_period;
+	unsigned int windows;
+} acline;
+
+/* A single optocoupler edge */
+struct sim_edge {
+	ktime_t timestamp;
+	bool rising;
+};
+
+/* True mains zero crossing, start of a cycle */
+struct sim_cycle {
+	double zero;
+	double period;
+};
+
+/* Firing time error of one half cycle, in ns */
+struct sim_errors {
+	s64 *ns;
+	size_t count;
+	size_t size;
+	double sum;
+	double sum_sq;
+	u32 hist[ERROR_BUCKETS];
+};
+
+static struct sim_stats {
+	unsigned long long cycles;
+	unsigned long long rising;
+	unsigned long long rejected;
+	unsigned long long missing;
+	unsigned long long glitches;
+	unsigned long long skipped;
+	unsigned long long steady;
+	struct sim_errors neg;
+	struct sim_errors pos;
+} stats;
+
+
+static void triacsim_print_params(char *argv)
+{
+	fprintf(FPRINTF_FD, "\nOpenIndoor AC line and TRIAC trigger timing simulator\n\n");
+	fprintf(FPRINTF_FD, "Usage:\n");
+	fprintf(FPRINTF_FD, "%s [options]\n", argv);
+	fprintf(FPRINTF_FD, "-f [Hz]\t\tmains frequency at start, %.0fHz by default\n", DEFAULT_FREQUENCY);
+	fprintf(FPRINTF_FD, "-d [Hz/s]\tfrequency drift, eg: -0.01 for a generator slowing down. None by default\n");
+	fprintf(FPRINTF_FD, "-j [us]\t\tedge noise standard deviation, %.0fus by default\n", DEFAULT_NOISE_US);
+	fprintf(FPRINTF_FD, "-a [us]\t\toptocoupler asymmetry (true hysteresis), %.0fus by default\n", DEFAULT_ASYMMETRY_US);
+	fprintf(FPRINTF_FD, "-g [%%]\t\tcycles with a spurious optocoupler pulse. None by default\n");
+	fprintf(FPRINTF_FD, "-m [%%]\t\tcycles with missing edges. None by default\n");
+	fprintf(FPRINTF_FD, "-t [sec]\tsimulated time, %.0fsec by default\n", DEFAULT_SECONDS);
+	fprintf(FPRINTF_FD, "-p [0-180]\tpositive phase conduction degrees, %u by default\n", DEFAULT_ANGLE);
+	fprintf(FPRINTF_FD, "-n [0-180]\tnegative phase conduction degrees, same as positive by default\n");
+	fprintf(FPRINTF_FD, "-c [us[/ns]]\tcached hysteresis [/period] passed to aclinedrv. Starts from %uus by default\n", DEFAULT_OPTOHYST_US);
+	fprintf(FPRINTF_FD, "-e [us]\t\tfail if 99th percentile of absolute error is over this limit\n");
+	fprintf(FPRINTF_FD, "-s [seed]\trandom seed, for repeatable runs\n");
+	fprintf(FPRINTF_FD, "\nEg: %s -f 50.5 -d -0.02 -j 50 -g 1\tto simulate a noisy generator slowing down\n", argv);
+	fprintf(FPRINTF_FD, "    %s -t 600 -e 30\t\t\tto fail if firing error goes over 30us on 10min\n", argv);
+	return;
+}
+
+/* Gaussian noise, Box-Muller */
+static double triacsim_gauss(double sigma)
+{
+	double u1, u2;
+
+	if (sigma <= 0)
+		return 0;
+
+	do {
+		u1 = drand48();
+	} while (u1 <= 0);
+	u2 = drand48();
+
+	return sigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/* Next true zero crossing. Frequency drifts linearly with time */
+static struct sim_cycle triacsim_next_cycle(const struct sim_params *params, struct sim_cycle cycle)
+{
+	double frequency;
+
+	cycle.zero += cycle.period;
+	frequency = params->frequency + params->drift * cycle.zero / SEC_TO_NANOSEC;
+	if (frequency < 1.0)
+		frequency = 1.0;
+	cycle.period = SEC_TO_NANOSEC / frequency;
+
+	return cycle;
+}
+
+static void triacsim_record(struct sim_errors *errors, s64 error)
+{
+	u64 abs_ns = error < 0 ? -error : error;
+	unsigned int b = 0;
+	s64 *ns;
+
+	if (errors->count == errors->size) {
+		errors->size = errors->size ? errors->size * 2 : 4096;
+		ns = realloc(errors->ns, errors->size * sizeof(s64));
+		if (ns == NULL) {
+			fprintf(FPRINTF_FD, "triacsim: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		errors->ns = ns;
+	}
+	errors->ns[errors->count++] = error;
+	errors->sum += error;
+	errors->sum_sq += (double)error * error;
+
+	while (abs_ns >> b && b < ERROR_BUCKETS - 1)
+		b++;
+	errors->hist[b]++;
+
+	return;
+}
+
+/* Falling edge ends optocoupler high time */
+static void triacsim_falling(ktime_t now)
+{
+	timing_calib_add(&acline.high, ktime_sub(now, acline.timestamp));
+	acline.falling = now;
+
+	return;
+}
+
+/* Rising edge, as aclinedrv IRQ handler takes it.
+ * Returns false if edge was rejected as noise
+ */
+static bool triacsim_rising(ktime_t now)
+{
+	unsigned int period_ns;
+
+	stats.rising++;
+	acline.old_timestamp = acline.timestamp;
+	acline.timestamp = now;
+	acline.period_time = ktime_sub(acline.timestamp, acline.old_timestamp);
+	if (!timing_pll_update(&acline.pll, acline.timestamp, acline.period_time, acline.cached_period)) {
+		stats.rejected++;
+		return false;
+	}
+
+	/* Filtered period is kept as cached one while locked */
+	period_ns = timing_period(&acline.pll, acline.period_time);
+	if (period_ns && acline.pll.locked)
+		acline.cached_period = period_ns;
+
+	/* Rising edge ends optocoupler low time */
+	timing_calib_add(&acline.low, ktime_sub(now, acline.falling));
+	if (timing_calib_window(&acline.high, &acline.low, &acline.opto_hysteresis))
+		acline.windows++;
+
+	return true;
+}
+
+/* Trigger computation, as triacdrv zero crossing callback does it,
+ * checked against ideal firing times of the true cycle
+ */
+static void triacsim_trigger(const struct sim_params *params, const struct sim_cycle *cycle)
+{
+	unsigned int pos = params->pos;
+	unsigned int neg = params->neg;
+	unsigned int period_ns, pos_ns, neg_ns;
+	ktime_t sync, irq_timestamp;
+	double ideal;
+
+	if (timing_bound_phases(&pos, &neg) != TIMING_PHASE) {
+		stats.steady++;
+		return;
+	}
+
+	period_ns = timing_period(&acline.pll, acline.period_time);
+	sync = acline.pll.locked ? acline.pll.sync : acline.timestamp;
+	irq_timestamp = ktime_add_ns(sync, acline.opto_hysteresis);
+
+	neg_ns = timing_phase_to_ns(neg, period_ns);
+	pos_ns = timing_phase_to_ns(pos, period_ns);
+	if (!period_ns || (!neg_ns && !pos_ns)) {
+		stats.skipped++;
+		return;
+	}
+
+	/* TRIAC trigger on negative cycle */
+	if (neg_ns) {
+		ideal = cycle->zero + (180 - neg) * cycle->period / 360;
+		triacsim_record(&stats.neg, ktime_add_ns(irq_timestamp, neg_ns) - llround(ideal));
+	}
+
+	/* TRIAC trigger on positive cycle */
+	if (pos_ns) {
+		ideal = cycle->zero + cycle->period / 2 + (180 - pos) * cycle->period / 360;
+		triacsim_record(&stats.pos, ktime_add_ns(irq_timestamp, pos_ns + period_ns / 2) - llround(ideal));
+	}
+
+	return;
+}
+
+static int triacsim_edge_cmp(const void *a, const void *b)
+{
+	const struct sim_edge *edge_a = a;
+	const struct sim_edge *edge_b = b;
+
+	return (edge_a->timestamp > edge_b->timestamp) - (edge_a->timestamp < edge_b->timestamp);
+}
+
+static int triacsim_s64_cmp(const void *a, const void *b)
+{
+	s64 x = *(const s64 *)a < 0 ? -*(const s64 *)a : *(const s64 *)a;
+	s64 y = *(const s64 *)b < 0 ? -*(const s64 *)b : *(const s64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Absolute error percentile, errors must be sorted */
+static double triacsim_percentile(const struct sim_errors *errors, double p)
+{
+	size_t i = (size_t)(p * (errors->count - 1) / 100.0 + 0.5);
+	s64 ns = errors->ns[i];
+
+	return (ns < 0 ? -ns : ns) / (double)USEC_TO_NANOSEC;
+}
+
+/* Prints error distribution of one half cycle.
+ * Returns 99th percentile of absolute error, in us
+ */
+static double triacsim_report(const char *name, struct sim_errors *errors, double period)
+{
+	double mean, std, p99;
+	unsigned int b;
+
+	if (!errors->count) {
+		printf("%s half cycle: no triggers\n", name);
+		return 0;
+	}
+
+	mean = errors->sum / errors->count;
+	std = sqrt(fmax(errors->sum_sq / errors->count - mean * mean, 0));
+	qsort(errors->ns, errors->count, sizeof(s64), triacsim_s64_cmp);
+	p99 = triacsim_percentile(errors, 99.0);
+
+	printf("%s half cycle: %zu triggers, mean %+.1fus, std %.1fus\n", name, errors->count,
+		   mean / USEC_TO_NANOSEC, std / USEC_TO_NANOSEC);
+	printf("\t|error| p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus (p99 %.3fdeg)\n",
+		   triacsim_percentile(errors, 50.0), p99, triacsim_percentile(errors, 99.9),
+		   triacsim_percentile(errors, 100.0), p99 * USEC_TO_NANOSEC * 360.0 / period);
+
+	for (b = 0; b < ERROR_BUCKETS; b++) {
+		if (!errors->hist[b])
+			continue;
+		if (b == ERROR_BUCKETS - 1)
+			printf("\t>= %lluns\t%u\n", 1ULL << (b - 1), errors->hist[b]);
+		else
+			printf("\t<  %lluns\t%u\n", 1ULL << b, errors->hist[b]);
+	}
+
+	return p99;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_params params = {
+		.frequency = DEFAULT_FREQUENCY,
+		.noise_us = DEFAULT_NOISE_US,
+		.asymmetry_us = DEFAULT_ASYMMETRY_US,
+		.seconds = DEFAULT_SECONDS,
+		.pos = DEFAULT_ANGLE,
+		.neg = DEFAULT_ANGLE,
+		.seed = 1,
+	};
+	struct sim_edge edges[CYCLE_EDGES];
+	struct sim_cycle cycle, next;
+	double asymmetry, glitch, p99_neg, p99_pos;
+	bool neg_set = false;
+	unsigned int i, n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:d:j:a:g:m:t:p:n:c:e:s:h")) != -1) {
+		switch (opt) {
+			case 'f':
+				params.frequency = atof(optarg);
+				break;
+			case 'd':
+				params.drift = atof(optarg);
+				break;
+			case 'j':
+				params.noise_us = atof(optarg);
+				break;
+			case 'a':
+				params.asymmetry_us = atof(optarg);
+				break;
+			case 'g':
+				params.glitch = atof(optarg) / 100.0;
+				break;
+			case 'm':
+				params.missing = atof(optarg) / 100.0;
+				break;
+			case 't':
+				params.seconds = atof(optarg);
+				break;
+			case 'p':
+				params.pos = atoi(optarg);
+				break;
+			case 'n':
+				params.neg = atoi(optarg);
+				neg_set = true;
+				break;
+			case 'c':
+				if (sscanf(optarg, "%u/%u", &params.optohyst_us, &params.period_ns) < 1) {
+					triacsim_print_params(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'e':
+				params.limit_us = atof(optarg);
+				break;
+			case 's':
+				params.seed = atol(optarg);
+				break;
+			default:
+				triacsim_print_params(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (!neg_set)
+		params.neg = params.pos;
+	if (params.frequency <= 0 || params.seconds <= 0 || params.pos > 180 || params.neg > 180) {
+		triacsim_print_params(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	srand48(params.seed);
+
+	/* Same start as aclinedrv init */
+	timing_pll_reset(&acline.pll);
+	acline.opto_hysteresis = (params.optohyst_us ? params.optohyst_us : DEFAULT_OPTOHYST_US) * USEC_TO_NANOSEC;
+	acline.cached_period = params.period_ns;
+
+	asymmetry = params.asymmetry_us * USEC_TO_NANOSEC;
+	/* First zero crossing a second in, so no edge goes before 0 */
+	cycle.zero = 0;
+	cycle.period = SEC_TO_NANOSEC;
+	cycle = triacsim_next_cycle(&params, cycle);
+	next = triacsim_next_cycle(&params, cycle);
+
+	while (cycle.zero < (params.seconds + 1.0) * SEC_TO_NANOSEC) {
+		stats.cycles++;
+		n = 0;
+
+		/* Optocoupler output goes high hysteresis before zero crossing,
+		 * and low hysteresis after half cycle zero crossing
+		 */
+		if (drand48() < params.missing)
+			stats.missing++;
+		else {
+			edges[n].timestamp = llround(cycle.zero - asymmetry + triacsim_gauss(params.noise_us * USEC_TO_NANOSEC));
+			edges[n++].rising = true;
+			edges[n].timestamp = llround(cycle.zero + cycle.period / 2 + asymmetry + triacsim_gauss(params.noise_us * USEC_TO_NANOSEC));
+			edges[n++].rising = false;
+		}
+
+		if (drand48() < params.glitch) {
+			stats.glitches++;
+			glitch = cycle.zero + drand48() * cycle.period;
+			edges[n].timestamp = llround(glitch);
+			edges[n++].rising = true;
+			edges[n].timestamp = llround(glitch) + GLITCH_WIDTH_ns;
+			edges[n++].rising = false;
+		}
+
+		qsort(edges, n, sizeof(struct sim_edge), triacsim_edge_cmp);
+
+		for (i = 0; i < n; i++) {
+			if (!edges[i].rising)
+				triacsim_falling(edges[i].timestamp);
+			/* An accepted glitch late on the cycle is taken as next zero crossing */
+			else if (triacsim_rising(edges[i].timestamp))
+				triacsim_trigger(&params, fabs(edges[i].timestamp - next.zero) < fabs(edges[i].timestamp - cycle.zero) ? &next : &cycle);
+		}
+
+		cycle = next;
+		next = triacsim_next_cycle(&params, next);
+	}
+
+	printf("triacsim: %.3fHz, drift %+.4fHz/s, noise %.1fus, asymmetry %.1fus, %.0fsec, %u/%u deg\n",
+		   params.frequency, params.drift, params.noise_us, params.asymmetry_us, params.seconds, params.pos, params.neg);
+	printf("edges: %llu cycles, %llu rising edges, %llu rejected, %llu missing cycles, %llu glitches\n",
+		   stats.cycles, stats.rising, stats.rejected, stats.missing, stats.glitches);
+	printf("tracking filter: %s, period %uns\n", acline.pll.locked ? "locked" : "not locked", timing_period(&acline.pll, acline.period_time));
+	printf("calibration: %u windows, hysteresis %uus (true %.0fus)\n", acline.windows,
+		   acline.opto_hysteresis / USEC_TO_NANOSEC, params.asymmetry_us);
+	if (stats.steady)
+		printf("channel driven steady, no triggers\n");
+	if (stats.skipped)
+		printf("%llu cycles skipped, no valid period\n", stats.skipped);
+
+	p99_neg = triacsim_report("negative", &stats.neg, SEC_TO_NANOSEC / params.frequency);
+	p99_pos = triacsim_report("positive", &stats.pos, SEC_TO_NANOSEC / params.frequency);
+
+	free(stats.neg.ns);
+	free(stats.pos.ns);
+
+	if (params.limit_us > 0 && (p99_neg > params.limit_us || p99_pos > params.limit_us)) {
+		fprintf(FPRINTF_FD, "triacsim: 99th percentile error over %.1fus limit\n", params.limit_us);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}